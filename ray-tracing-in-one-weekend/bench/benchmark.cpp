@@ -0,0 +1,414 @@
+// Benchmark suite: micro-benchmarks of the hot functions of a render (box, sphere and BVH hits, BVH
+// build, camera rays, material scatter) on the objects of random_scene(), full renders of
+// random_scene() at fixed seeds, and png writing. Results go to stdout, or to the --json file, as JSON:
+//   { "threads": n, "peak_memory_bytes": n, "benchmarks": [ { "name", "ops", "seconds", "ns_per_op",
+//     "mrays_per_s" (ray benchmarks only), "checksum", ... }, ... ] }
+// peak_memory_bytes is the high-water mark of the whole run, not of any single benchmark.
+// The checksum counts hits or scattered rays; it keeps the work from being optimized away and
+// changes when a change to the code changes results.
+//
+// Usage: benchmark [--json <path>] [--min-time <seconds>] [--filter <name part>] [--spp <n>]
+//                  [--seeds <n>] [--width <pixels>] [--threads <n>]
+
+#include "../src/objects/sphere.h"
+#include "../src/objects/moving_sphere.h"
+#include "../src/camera/camera.h"
+#include "../src/utils/material.h"
+#include "../src/bvh/bvh.h"
+#include "../src/bvh/linear_bvh.h"
+#include "../src/render/renderer.h"
+#include "../src/scene/scenes.h"
+#include "../src/utils/png_writer.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+struct BenchOptions {
+    std::string json_path;   // empty: stdout
+    double min_time = 0.5;   // seconds each micro-benchmark runs at least
+    std::string filter;      // run only benchmarks whose name contains it
+    int samples_per_pixel = 8;
+    int seed_count = 3;      // renders of random_scene() with seeds 1 to seed_count
+    int image_width = 400;
+    int thread_count = 0;
+};
+
+// Largest resident set of the process so far
+static uint64_t peak_memory_bytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// One benchmark as a JSON object, fields in the order they were added
+class JsonRecord {
+public:
+    template <class T>
+    JsonRecord& field(const char* key, const T& value) {
+        separator();
+        out << '"' << key << "\": " << value;
+        return *this;
+    }
+
+    JsonRecord& field(const char* key, const std::string& value) {
+        separator();
+        out << '"' << key << "\": \"" << value << '"';
+        return *this;
+    }
+
+    std::string str() const { return "{ " + out.str() + " }"; }
+
+private:
+    void separator() {
+        if (!first)
+            out << ", ";
+        first = false;
+    }
+
+    std::ostringstream out;
+    bool first = true;
+};
+
+class Suite {
+public:
+    explicit Suite(const BenchOptions& options) : options(options) {}
+
+    bool selected(const std::string& name) const {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    // Calls batch, which does batch_ops operations and returns a checksum, with twice the repeats
+    // each time until the repeats take min_time. ns_per_op comes from that last run.
+    template <class Batch>
+    void measure(const std::string& name, double batch_ops, bool rays, Batch batch) {
+        if (!selected(name))
+            return;
+        uint64_t checksum = batch(); // warm up
+        int repeat = 1;
+        double seconds = 0;
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < repeat; i++)
+                checksum = batch();
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds >= options.min_time || repeat >= (1 << 24))
+                break;
+            repeat *= 2;
+        }
+        double ops = batch_ops * repeat;
+        JsonRecord record;
+        record.field("name", name).field("ops", ops).field("seconds", seconds)
+            .field("ns_per_op", seconds / ops * 1e9);
+        if (rays)
+            record.field("mrays_per_s", ops / seconds * 1e-6);
+        record.field("checksum", checksum);
+        std::cerr << name << ": " << seconds / ops * 1e9 << " ns/op\n";
+        add(record);
+    }
+
+    void add(const JsonRecord& record) { records.push_back(record.str()); }
+
+    std::string json(int thread_count) const {
+        std::ostringstream out;
+        out << "{\n  \"threads\": " << thread_count << ",\n  \"peak_memory_bytes\": " << peak_memory_bytes()
+            << ",\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < records.size(); i++)
+            out << "    " << records[i] << (i + 1 < records.size() ? ",\n" : "\n");
+        out << "  ]\n}\n";
+        return out.str();
+    }
+
+private:
+    const BenchOptions& options;
+    std::vector<std::string> records;
+};
+
+// Camera of main.cpp, main.cpp keeps the shutter closed
+static Camera make_camera(float aspect_ratio, float time_close)
+{
+    return Camera(vec3f(13, 2, 3), vec3f(0, 0, 0), vec3f(0, 1, 0), 20, aspect_ratio, 0.1f, 10.0f, 0, time_close);
+}
+
+static std::vector<Ray> make_camera_rays(const Camera& cam, int count, Sampler& sampler)
+{
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++)
+        rays.push_back(cam.get_ray(random_float(sampler), random_float(sampler), sampler));
+    return rays;
+}
+
+template <class Object>
+static std::vector<const Object*> objects_of_type(const HittableList& world)
+{
+    std::vector<const Object*> found;
+    for (const auto& object : world.objects) {
+        if (auto typed = dynamic_cast<const Object*>(object.get()))
+            found.push_back(typed);
+    }
+    return found;
+}
+
+template <class Object>
+static uint64_t hit_all(const std::vector<const Object*>& objects, const std::vector<Ray>& rays)
+{
+    uint64_t hits = 0;
+    HitRecord rec;
+    for (const Ray& r : rays) {
+        for (const Object* object : objects)
+            hits += object->hit(r, 0.001f, FLT_MAX, rec) ? 1 : 0;
+    }
+    return hits;
+}
+
+// Rays that hit a surface of material type M, with their hit records
+template <class M>
+static void collect_hits(const Hittable& world, const MaterialTable& materials, const std::vector<Ray>& rays,
+    std::vector<Ray>& hit_rays, std::vector<HitRecord>& records)
+{
+    HitRecord rec;
+    for (const Ray& r : rays) {
+        if (world.hit(r, 0.001f, FLT_MAX, rec) && dynamic_cast<const M*>(&materials[rec.material_id])) {
+            hit_rays.push_back(r);
+            records.push_back(rec);
+        }
+    }
+}
+
+template <class M>
+static void measure_scatter(Suite& suite, const std::string& name, const Hittable& world,
+    const MaterialTable& materials, const std::vector<Ray>& rays)
+{
+    std::vector<Ray> hit_rays;
+    std::vector<HitRecord> records;
+    collect_hits<M>(world, materials, rays, hit_rays, records);
+    if (hit_rays.empty()) {
+        std::cerr << name << ": no hits on the material\n";
+        return;
+    }
+    Sampler sampler(7);
+    suite.measure(name, static_cast<double>(hit_rays.size()), false, [&]() {
+        uint64_t scattered_count = 0;
+        Eigen::Vector3f attenuation;
+        Ray scattered;
+        for (size_t k = 0; k < hit_rays.size(); k++)
+            scattered_count += materials[records[k].material_id].scatter(
+                hit_rays[k], records[k], attenuation, scattered, sampler) ? 1 : 0;
+        return scattered_count;
+    });
+}
+
+static void run_micro(Suite& suite)
+{
+    default_sampler() = Sampler(1);
+    MaterialTable materials;
+    HittableList world = random_scene(materials);
+    const float aspect_ratio = 16.0f / 9.0f;
+    Camera cam = make_camera(aspect_ratio, 1); // rays at every time, for the moving spheres
+    Sampler sampler(1);
+    std::vector<Ray> rays = make_camera_rays(cam, 4096, sampler);
+
+    // Primitive tests: every ray against every object of a type
+    std::vector<Aabb> boxes;
+    for (const auto& object : world.objects) {
+        Aabb box;
+        if (object->bounding_box(0, 1, box))
+            boxes.push_back(box);
+    }
+    std::vector<TraversalRay> traversal_rays(rays.begin(), rays.end());
+    suite.measure("aabb_hit", static_cast<double>(rays.size()) * boxes.size(), true, [&]() {
+        uint64_t hits = 0;
+        for (const TraversalRay& r : traversal_rays) {
+            for (const Aabb& box : boxes)
+                hits += box.hit(r, 0.001f, FLT_MAX) ? 1 : 0;
+        }
+        return hits;
+    });
+    std::vector<const Sphere*> spheres = objects_of_type<Sphere>(world);
+    suite.measure("sphere_hit", static_cast<double>(rays.size()) * spheres.size(), true,
+        [&]() { return hit_all(spheres, rays); });
+    std::vector<const MovingSphere*> moving_spheres = objects_of_type<MovingSphere>(world);
+    suite.measure("moving_sphere_hit", static_cast<double>(rays.size()) * moving_spheres.size(), true,
+        [&]() { return hit_all(moving_spheres, rays); });
+
+    // Acceleration structures, built on one thread so the times do not depend on the machine size
+    suite.measure("bvh_build", 1, false, [&]() {
+        BvhNode root(world, 0, 1);
+        return static_cast<uint64_t>(root.box.surface_area());
+    });
+    BvhNode root(world, 0, 1);
+    LinearBvh linear(root, 0, 1);
+    std::vector<Ray> bvh_rays = make_camera_rays(cam, 1 << 16, sampler);
+    auto trace = [&](const Hittable& accel) {
+        uint64_t hits = 0;
+        HitRecord rec;
+        for (const Ray& r : bvh_rays)
+            hits += accel.hit(r, 0.001f, FLT_MAX, rec) ? 1 : 0;
+        return hits;
+    };
+    suite.measure("bvh_node_hit", static_cast<double>(bvh_rays.size()), true, [&]() { return trace(root); });
+    suite.measure("linear_bvh_hit", static_cast<double>(bvh_rays.size()), true, [&]() { return trace(linear); });
+
+    std::vector<float> uv(2 * 4096);
+    for (float& value : uv)
+        value = random_float(sampler);
+    suite.measure("camera_get_ray", 4096, true, [&]() {
+        uint64_t forward = 0;
+        for (size_t k = 0; k < uv.size(); k += 2)
+            forward += cam.get_ray(uv[k], uv[k + 1], sampler).direction().x() < 0 ? 1 : 0;
+        return forward;
+    });
+
+    measure_scatter<Lambertian>(suite, "lambertian_scatter", root, materials, bvh_rays);
+    measure_scatter<Metal>(suite, "metal_scatter", root, materials, bvh_rays);
+    measure_scatter<Dielectric>(suite, "dielectric_scatter", root, materials, bvh_rays);
+}
+
+// random_scene() with the seed, rendered like main.cpp does by default
+static void run_render(Suite& suite, const BenchOptions& options, ThreadPool& pool, int seed)
+{
+    std::string name = "render_random_scene_seed_" + std::to_string(seed);
+    if (!suite.selected(name))
+        return;
+    default_sampler() = Sampler(seed);
+    MaterialTable materials;
+    HittableList world = random_scene(materials);
+    BvhBuildOptions bvh_options;
+    bvh_options.pool = &pool;
+    BvhNode root(world, 0, 0, bvh_options);
+    LinearBvh accel(root, 0, 0);
+
+    const float aspect_ratio = 16.0f / 9.0f;
+    const int image_width = options.image_width;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    Camera cam = make_camera(aspect_ratio, 0);
+    RenderOptions render_options;
+    render_options.samples_per_pixel = options.samples_per_pixel;
+    render_options.max_depth = 20;
+    render_options.seed = seed;
+    Renderer renderer(render_options, pool);
+    Image img(image_width, image_height);
+
+    auto start = std::chrono::steady_clock::now();
+    renderer.render(accel, materials, cam, img);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "\n";
+
+    uint64_t checksum = 0;
+    for (int j = 0; j < image_height; j++) {
+        for (int i = 0; i < image_width; i++) {
+            Eigen::Vector3f color = img.getPixel(i, j);
+            checksum += static_cast<uint64_t>(255.999f * clamp(color.x() + color.y() + color.z(), 0, 3));
+        }
+    }
+    double rays = static_cast<double>(renderer.get_ray_count());
+    JsonRecord record;
+    record.field("name", name).field("ops", rays).field("seconds", seconds).field("ns_per_op", seconds / rays * 1e9)
+        .field("mrays_per_s", rays / seconds * 1e-6).field("checksum", checksum)
+        .field("width", image_width).field("height", image_height)
+        .field("samples_per_pixel", options.samples_per_pixel).field("objects", world.objects.size());
+    suite.add(record);
+}
+
+// write_png at a fast and the default compression level, on the pool, of a 1920x1080 gradient with
+// per-pixel noise like that of a render at few samples. The checksum is the file size.
+static void run_png(Suite& suite, ThreadPool& pool)
+{
+    const int width = 1920, height = 1080;
+    const size_t stride = static_cast<size_t>(width) * 3;
+    std::vector<unsigned char> pixels(stride * height);
+    Sampler sampler(1);
+    for (int j = 0; j < height; j++) {
+        for (size_t i = 0; i < stride; i++) {
+            float value = 0.5f * i / stride + 0.3f * j / height + 0.2f * random_float(sampler);
+            pixels[j * stride + i] = static_cast<unsigned char>(255.999f * value);
+        }
+    }
+    const std::string path = "benchmark_png_write.png";
+    for (int level : { 1, 6 }) {
+        PngOptions png_options;
+        png_options.compression_level = level;
+        png_options.pool = &pool;
+        suite.measure("png_write_level_" + std::to_string(level), static_cast<double>(width) * height, false, [&]() {
+            write_png(path, width, height, [&](int y, unsigned char* rgb) {
+                std::copy(&pixels[y * stride], &pixels[(y + 1) * stride], rgb);
+            }, png_options);
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            return static_cast<uint64_t>(file.tellg());
+        });
+    }
+    std::remove(path.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--json") == 0 && has_value)
+            options.json_path = argv[++i];
+        else if (strcmp(argv[i], "--min-time") == 0 && has_value)
+            options.min_time = atof(argv[++i]);
+        else if (strcmp(argv[i], "--filter") == 0 && has_value)
+            options.filter = argv[++i];
+        else if (strcmp(argv[i], "--spp") == 0 && has_value)
+            options.samples_per_pixel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seeds") == 0 && has_value)
+            options.seed_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--width") == 0 && has_value)
+            options.image_width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+            options.thread_count = atoi(argv[++i]);
+        else
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+    }
+
+    Suite suite(options);
+    run_micro(suite);
+    ThreadPool pool(options.thread_count);
+    for (int seed = 1; seed <= options.seed_count; seed++)
+        run_render(suite, options, pool, seed);
+    run_png(suite, pool);
+
+    std::string json = suite.json(static_cast<int>(pool.size()));
+    if (options.json_path.empty()) {
+        std::cout << json;
+    }
+    else {
+        std::ofstream file(options.json_path);
+        if (!(file << json)) {
+            std::cerr << "Cannot write " << options.json_path << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,207 @@
+// Traversal micro-benchmark: closest-hit and occlusion queries against the binary BvhNode tree,
+// the flattened LinearBvh and the 4 / 8 wide BVHs with scalar and SIMD box tests.
+//
+// Usage: bvh_traversal [--spheres <n>] [--rays <n>] [--bvh <median|sah|morton>] [--repeat <n>]
+//                      [--pack <leaf size>] [--sphere-simd <1|8|16>]
+
+#include "../src/objects/sphere.h"
+#include "../src/objects/sphere_soa.h"
+#include "../src/utils/material.h"
+#include "../src/bvh/bvh.h"
+#include "../src/bvh/linear_bvh.h"
+#include "../src/bvh/wide_bvh.h"
+
+#include <cfloat>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Spheres of radius 0.2 spread through a cube, the same layout as spheres_scene() in main.cpp
+static HittableList make_spheres(int count, MaterialTable& materials)
+{
+    HittableList world;
+    MaterialId material = materials.add(make_shared<Lambertian>(vec3f(0.5f, 0.5f, 0.5f)));
+    float half_extent = 2.0f * cbrtf(static_cast<float>(count));
+    world.objects.reserve(count);
+    for (int i = 0; i < count; i++) {
+        vec3f center = random_vec3f(-half_extent, half_extent);
+        world.add(make_shared<Sphere>(center, 0.2f, material));
+    }
+    return world;
+}
+
+// Half of the rays come from outside the scene and aim at a point inside, like camera rays;
+// the other half start inside in random directions, like bounce rays.
+static std::vector<Ray> make_rays(const Aabb& bounds, int count)
+{
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    vec3f center = bounds.centroid();
+    float radius = (bounds.max() - bounds.min()).norm();
+    for (int i = 0; i < count; i++) {
+        vec3f target = random_vec3f(0, 1).cwiseProduct(bounds.max() - bounds.min()) + bounds.min();
+        if (i % 2 == 0) {
+            vec3f origin = center + radius * random_vec3f(-1, 1).normalized();
+            rays.push_back(Ray(origin, (target - origin).normalized(), 0));
+        }
+        else {
+            rays.push_back(Ray(target, random_vec3f(-1, 1).normalized(), 0));
+        }
+    }
+    return rays;
+}
+
+// The Sphere, its shared_ptr control block and the shared_ptr in the leaf
+static const size_t sphere_object_bytes = sizeof(Sphere) + 2 * sizeof(void*) + sizeof(shared_ptr<Hittable>);
+
+// Sphere groups of a packed tree, and the spheres its leaves still hold one by one
+static void collect_groups(const Hittable& object, std::vector<const SphereSoA*>& groups, size_t& loose_spheres)
+{
+    if (auto node = dynamic_cast<const BvhNode*>(&object)) {
+        collect_groups(*node->left, groups, loose_spheres);
+        if (node->right != node->left)
+            collect_groups(*node->right, groups, loose_spheres);
+    }
+    else if (auto list = dynamic_cast<const HittableList*>(&object)) {
+        for (const auto& item : list->objects)
+            collect_groups(*item, groups, loose_spheres);
+    }
+    else if (auto group = dynamic_cast<const SphereSoA*>(&object)) {
+        groups.push_back(group);
+    }
+    else if (dynamic_cast<const Sphere*>(&object)) {
+        loose_spheres++;
+    }
+}
+
+struct Result {
+    size_t hits = 0;
+    double t_sum = 0;
+};
+
+static Result trace_all(const Hittable& accel, const std::vector<Ray>& rays)
+{
+    Result result;
+    HitRecord rec;
+    for (const Ray& r : rays) {
+        if (accel.hit(r, 0.001f, FLT_MAX, rec)) {
+            result.hits++;
+            result.t_sum += rec.t;
+        }
+    }
+    return result;
+}
+
+static size_t occlude_all(const Hittable& accel, const std::vector<Ray>& rays)
+{
+    size_t blocked = 0;
+    for (const Ray& r : rays)
+        blocked += accel.occluded(r, 0.001f, FLT_MAX) ? 1 : 0;
+    return blocked;
+}
+
+static void run(const char* name, const Hittable& accel, const std::vector<Ray>& rays, int repeat,
+    const Result& reference)
+{
+    Result result;
+    TraversalStats before = thread_traversal_stats();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++)
+        result = trace_all(accel, rays);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double queries = static_cast<double>(rays.size()) * repeat;
+    TraversalStats stats = thread_traversal_stats() - before;
+
+    std::cout << name << ": " << queries / seconds * 1e-6 << " Mrays/s, "
+        << seconds / queries * 1e9 << " ns/ray, " << stats.nodes_per_query() << " nodes/ray, "
+        << stats.primitives_per_query() << " primitives/ray, " << result.hits << " hits";
+    // Sphere::hit reports some rays that pass just outside a sphere as hits, in float precision.
+    // Structures that test a box per primitive reject a few of them, so their counts may be lower.
+    if (result.hits != reference.hits || result.t_sum != reference.t_sum)
+        std::cout << " (reference " << reference.hits << ")";
+    std::cout << "\n";
+
+    size_t blocked = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++)
+        blocked = occlude_all(accel, rays);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  occluded: " << queries / seconds * 1e-6 << " Mrays/s, " << seconds / queries * 1e9
+        << " ns/ray, " << blocked << " blocked\n";
+}
+
+int main(int argc, char* argv[])
+{
+    int sphere_count = 100000;
+    int ray_count = 1000000;
+    int repeat = 1;
+    BvhBuildOptions options;
+    options.split_method = BvhSplitMethod::Sah;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--spheres") == 0 && has_value)
+            sphere_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rays") == 0 && has_value)
+            ray_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--repeat") == 0 && has_value)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--pack") == 0 && has_value) {
+            options.max_leaf_size = atoi(argv[++i]);
+            options.pack_spheres = options.max_leaf_size > 1;
+        }
+        else if (strcmp(argv[i], "--sphere-simd") == 0 && has_value)
+            SphereSoA::set_simd_width(atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bvh") == 0 && has_value) {
+            const char* method = argv[++i];
+            if (strcmp(method, "median") == 0)
+                options.split_method = BvhSplitMethod::Median;
+            else if (strcmp(method, "morton") == 0)
+                options.split_method = BvhSplitMethod::Morton;
+            else
+                options.split_method = BvhSplitMethod::Sah;
+        }
+        else
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+    }
+
+    MaterialTable materials;
+    HittableList world = make_spheres(sphere_count, materials);
+    BvhNode root(world, 0, 0, options);
+    // The tree holds its own references; without this the spheres copied into groups stay alive
+    world.clear();
+    std::vector<Ray> rays = make_rays(root.box, ray_count);
+
+    LinearBvh linear(root, 0, 0);
+    Bvh4 bvh4_scalar(root, 0, 0, false), bvh4(root, 0, 0);
+    Bvh8 bvh8_scalar(root, 0, 0, false), bvh8(root, 0, 0);
+
+    std::cout << sphere_count << " spheres, " << ray_count << " rays x " << repeat << "\n";
+    if (options.pack_spheres) {
+        std::vector<const SphereSoA*> groups;
+        size_t loose = 0;
+        collect_groups(root, groups, loose);
+        size_t packed = 0;
+        double bytes = static_cast<double>(loose * sphere_object_bytes);
+        for (const SphereSoA* group : groups) {
+            packed += group->size();
+            bytes += group->bytes_per_sphere() * group->size();
+        }
+        std::cout << packed << " spheres in " << groups.size() << " groups, " << loose << " loose, "
+            << bytes / std::max<size_t>(packed + loose, 1) << " bytes per sphere, "
+            << SphereSoA::simd_width() << " spheres per test\n";
+    }
+    else {
+        std::cout << sphere_object_bytes << " bytes per sphere\n";
+    }
+    Result reference = trace_all(root, rays);
+
+    run("BvhNode", root, rays, repeat, reference);
+    run("LinearBvh", linear, rays, repeat, reference);
+    run("Bvh4 scalar", bvh4_scalar, rays, repeat, reference);
+    run((std::string("Bvh4 ") + bvh4.kernel_name()).c_str(), bvh4, rays, repeat, reference);
+    run("Bvh8 scalar", bvh8_scalar, rays, repeat, reference);
+    run((std::string("Bvh8 ") + bvh8.kernel_name()).c_str(), bvh8, rays, repeat, reference);
+    return 0;
+}
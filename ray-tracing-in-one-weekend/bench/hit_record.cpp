@@ -0,0 +1,160 @@
+// Hit record micro-benchmark: closest-hit loops over a list of spheres that share a few materials,
+// once with hit records holding a shared_ptr<Material> (the former HitRecord::mat_ptr) and once with
+// a MaterialId. Every hit and every record copy of the first variant changes a reference count, so
+// its cost grows with the number of threads hitting the same materials.
+//
+// Usage: hit_record [--threads <n>] [--spheres <n>] [--rays <n>] [--materials <n>]
+
+#include "../src/utils/global.h"
+#include "../src/utils/material.h"
+
+#include <cfloat>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+struct SharedMaterialRecord {
+    vec3f p;
+    vec3f normal;
+    shared_ptr<Material> mat_ptr;
+    float t;
+    bool front_face;
+};
+
+struct MaterialIdRecord {
+    vec3f p;
+    vec3f normal;
+    MaterialId material_id;
+    float t;
+    bool front_face;
+};
+
+struct BenchSphere {
+    vec3f center;
+    float radius;
+    shared_ptr<Material> mat_ptr;
+    MaterialId material_id;
+};
+
+static void set_material(SharedMaterialRecord& rec, const BenchSphere& sphere) { rec.mat_ptr = sphere.mat_ptr; }
+static void set_material(MaterialIdRecord& rec, const BenchSphere& sphere) { rec.material_id = sphere.material_id; }
+
+// Same arithmetic as Sphere::hit
+template <class Record>
+static bool hit_sphere(const BenchSphere& sphere, const Ray& r, float t_min, float t_max, Record& rec)
+{
+    vec3f oc = r.start() - sphere.center;
+    float a = r.direction().dot(r.direction());
+    float half_b = oc.dot(r.direction());
+    float c = oc.dot(oc) - sphere.radius * sphere.radius;
+    float discriminant = half_b * half_b - a * c;
+    if (discriminant < 0)
+        return false;
+    float sqrtd = sqrt(discriminant);
+    float root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+    rec.t = root;
+    rec.p = r.at(root);
+    vec3f outward_normal = (rec.p - sphere.center) / sphere.radius;
+    rec.front_face = r.direction().dot(outward_normal) < 0;
+    rec.normal = rec.front_face ? outward_normal : -outward_normal;
+    set_material(rec, sphere);
+    return true;
+}
+
+// Same structure as HittableList::hit, including the copy of the temporary record
+template <class Record>
+static size_t trace(const std::vector<BenchSphere>& spheres, const std::vector<Ray>& rays, size_t begin, size_t end)
+{
+    size_t hits = 0;
+    for (size_t i = begin; i < end; i++) {
+        Record rec, temp_rec;
+        float closest = FLT_MAX;
+        bool hit_anything = false;
+        for (const BenchSphere& sphere : spheres) {
+            if (hit_sphere(sphere, rays[i], 0.001f, closest, temp_rec)) {
+                hit_anything = true;
+                closest = temp_rec.t;
+                rec = temp_rec;
+            }
+        }
+        hits += hit_anything ? 1 : 0;
+    }
+    return hits;
+}
+
+template <class Record>
+static void run(const char* name, const std::vector<BenchSphere>& spheres, const std::vector<Ray>& rays,
+    int thread_count)
+{
+    std::vector<size_t> hits(thread_count);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < thread_count; t++) {
+        size_t begin = rays.size() * t / thread_count, end = rays.size() * (t + 1) / thread_count;
+        threads.emplace_back([&, t, begin, end]() { hits[t] = trace<Record>(spheres, rays, begin, end); });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t total_hits = 0;
+    for (size_t h : hits)
+        total_hits += h;
+    double tests = static_cast<double>(rays.size()) * spheres.size();
+    std::cout << name << ": " << seconds * 1e3 << " ms, " << tests / seconds * 1e-6 << " M sphere tests/s, "
+        << total_hits << " rays hit\n";
+}
+
+int main(int argc, char* argv[])
+{
+    int thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    int sphere_count = 64;
+    int ray_count = 1000000;
+    int material_count = 4;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--threads") == 0 && has_value)
+            thread_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--spheres") == 0 && has_value)
+            sphere_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rays") == 0 && has_value)
+            ray_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--materials") == 0 && has_value)
+            material_count = atoi(argv[++i]);
+        else
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+    }
+    thread_count = std::max(thread_count, 1);
+    material_count = std::max(material_count, 1);
+
+    MaterialTable materials;
+    std::vector<shared_ptr<Material>> material_ptrs;
+    for (int m = 0; m < material_count; m++) {
+        material_ptrs.push_back(make_shared<Lambertian>(random_vec3f()));
+        materials.add(material_ptrs.back());
+    }
+
+    // Overlapping spheres in a unit cube, so most rays hit several of them
+    std::vector<BenchSphere> spheres(sphere_count);
+    for (int i = 0; i < sphere_count; i++) {
+        int m = i % material_count;
+        spheres[i] = { random_vec3f(-1, 1), 0.3f, material_ptrs[m], static_cast<MaterialId>(m) };
+    }
+    std::vector<Ray> rays;
+    rays.reserve(ray_count);
+    for (int i = 0; i < ray_count; i++)
+        rays.push_back(Ray(random_vec3f(-2, 2), random_vec3f(-1, 1).normalized(), 0));
+
+    std::cout << sphere_count << " spheres, " << material_count << " materials, " << ray_count << " rays, "
+        << thread_count << " threads\n";
+    run<SharedMaterialRecord>("shared_ptr<Material>", spheres, rays, thread_count);
+    run<MaterialIdRecord>("MaterialId", spheres, rays, thread_count);
+    return 0;
+}
@@ -1,84 +1,253 @@
 #include "src/ray/ray.h"
 #include "src/utils/image.h"
+#include "src/utils/heatmap.h"
 #include "src/objects/sphere.h"
 #include "src/objects/moving_sphere.h"
+#include "src/objects/sphere_soa.h"
 #include "src/camera/camera.h"
 #include "src/utils/global.h"
 #include "src/utils/material.h"
 #include "src/bvh/bvh.h"
+#include "src/bvh/linear_bvh.h"
+#include "src/bvh/wide_bvh.h"
+#include "src/render/renderer.h"
+#include "src/scene/scenes.h"
+#include "src/utils/trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <string>
 
-Eigen::Vector3f ray_color(const Ray& r, const Hittable& world, int depth)
+// Acceleration structure the image is rendered with
+enum class AccelKind {
+    Tree,   // BvhNode
+    Linear, // LinearBvh
+    Wide4,  // Bvh4
+    Wide8   // Bvh8
+};
+
+struct AppOptions {
+    RenderOptions render;
+    BvhBuildOptions bvh;
+    int sphere_count = 0;     // 0: random_scene(), otherwise spheres_scene(sphere_count)
+    AccelKind accel = AccelKind::Linear;
+    bool simd = true;         // wide BVHs and sphere groups: use SSE / AVX / AVX-512 when the CPU has them
+    std::string reference;    // image to print the RMSE of the render against, in 8 bit steps
+    std::string trace;        // Chrome trace-event JSON written at exit, see trace.h
+    PngOptions png;           // of the rendered image, encoded on the render pool
+};
+
+// Writes the pixel costs of a render with RenderOptions::cost_maps as heatmaps of the per-sample
+// averages, output/test_cost_<nodes|primitives|path_length>.png, and the tile sums as
+// output/test_tile_costs.csv. The heatmaps saturate at the 99th percentile.
+void save_cost_maps(const Renderer& renderer, int width, int height)
 {
-    if (depth <= 0)
-        return Eigen::Vector3f(0, 0, 0);
-
-    HitRecord rec;
-    float bias = 0.001;
-    if (world.hit(r, bias, FLT_MAX, rec)) 
-    {
-        Ray scattered;
-        Eigen::Vector3f attenuation;
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return multi_respectively(attenuation, ray_color(scattered, world, depth - 1));
-        return Eigen::Vector3f(0, 0, 0);
+    const PixelCosts& costs = renderer.get_pixel_costs();
+    const float scale = 1.0f / renderer.get_options().samples_per_pixel;
+    auto save_map = [&](const std::vector<uint64_t>& counts, const char* name) {
+        std::vector<float> values(counts.size());
+        for (size_t k = 0; k < counts.size(); k++)
+            values[k] = counts[k] * scale;
+        make_heatmap(values, width, height, percentile(values, 0.99f)).save(name);
+    };
+#ifdef RT_NO_STATS
+    std::cerr << "\nBuilt without ray statistics, the node and primitive cost maps stay black";
+#endif
+    save_map(costs.node_visits, "test_cost_nodes");
+    save_map(costs.primitive_tests, "test_cost_primitives");
+    save_map(costs.rays, "test_cost_path_length");
+
+    std::vector<TileCost> tiles = renderer.get_tile_costs();
+    std::ofstream csv("output/test_tile_costs.csv");
+    csv << "x0,y0,x1,y1,node_visits,primitive_tests,rays\n";
+    for (const TileCost& cost : tiles) {
+        csv << cost.tile.x0 << ',' << cost.tile.y0 << ',' << cost.tile.x1 << ',' << cost.tile.y1 << ','
+            << cost.node_visits << ',' << cost.primitive_tests << ',' << cost.rays << '\n';
+    }
+    if (!csv)
+        std::cerr << "\nCannot write output/test_tile_costs.csv";
+
+    std::sort(tiles.begin(), tiles.end(),
+        [](const TileCost& a, const TileCost& b) { return a.node_visits > b.node_visits; });
+    std::cerr << "\nTiles with the most node visits:";
+    for (size_t t = 0; t < std::min<size_t>(tiles.size(), 5); t++) {
+        const TileCost& cost = tiles[t];
+        std::cerr << "\n  [" << cost.tile.x0 << ", " << cost.tile.x1 << ") x [" << cost.tile.y0 << ", "
+            << cost.tile.y1 << "): " << cost.node_visits << " nodes, " << cost.primitive_tests << " primitives, "
+            << cost.rays << " rays";
     }
-    Eigen::Vector3f unit_direction = r.direction().normalized();
-    float t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * Eigen::Vector3f(1.0, 1.0, 1.0) + t * Eigen::Vector3f(0.5, 0.7, 1.0);
 }
 
-HittableList random_scene() {
-    HittableList world;
-
-    auto ground_material = make_shared<Lambertian>(vec3f(0.5, 0.5, 0.5));
-    world.add(make_shared<Sphere>(vec3f(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_float();
-            vec3f center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
-
-            if ((center - vec3f(4, 0.2, 0)).norm() > 0.9) {
-                shared_ptr<Material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = random_vec3f();
-                    sphere_material = make_shared<Lambertian>(albedo);
-                    world.add(make_shared<Sphere>(center, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = random_vec3f(0.5, 1);
-                    auto fuzz = random_float(0, 0.5);
-                    sphere_material = make_shared<Metal>(albedo, fuzz);
-                    auto center2 = center + vec3f(0, random_float(0, .5), 0);
-                    world.add(make_shared<MovingSphere>(
-                        center, center2, 0.0, 1.0, 0.2, sphere_material));
-                }
-                else {
-                    // glass
-                    sphere_material = make_shared<Dielectric>(1.5);
-                    world.add(make_shared<Sphere>(center, 0.2, sphere_material));
-                }
+// Root mean square difference of the 8 bit values img is saved with and those of the png at path.
+// Negative when the png cannot be read or has another size.
+float rmse_against(Image& img, const std::string& path)
+{
+    Image reference;
+    if (!reference.load(path) || reference.getWidth() != img.getWidth() || reference.getHeight() != img.getHeight())
+        return -1.0f;
+    double sum = 0.0;
+    for (int y = 0; y < img.getHeight(); y++) {
+        for (int x = 0; x < img.getWidth(); x++) {
+            // Image::save writes the rows top-down, Image::load keeps them in file order
+            Eigen::Vector3f pixel = img.getPixel(x, y);
+            Eigen::Vector3f expected = reference.getPixel(x, img.getHeight() - 1 - y);
+            for (int c = 0; c < 3; c++) {
+                float value = static_cast<float>(static_cast<int>(clamp(pixel[c], 0.0, 1) * 255.999));
+                float difference = value - std::round(expected[c] * 255.0f);
+                sum += difference * difference;
             }
         }
     }
+    return static_cast<float>(std::sqrt(sum / (3.0 * img.getWidth() * img.getHeight())));
+}
 
-    auto material1 = make_shared<Dielectric>(1.5);
-    world.add(make_shared<Sphere>(vec3f(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<Lambertian>(vec3f(0.4, 0.2, 0.1));
-    world.add(make_shared<Sphere>(vec3f(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<Metal>(vec3f(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<Sphere>(vec3f(4, 1, 0), 1.0, material3));
-
-    return world;
+// Command line: --threads <n> (0 = all cores), --tile <pixels>, --seed <n>, --spp <n>, --depth <n>,
+//               --bvh <median|sah|morton>, --bvh-quality <fast|medium|high>, --bvh-bins <n>, --bvh-leaf <n>,
+//               --bvh-traversal-cost <ratio>, --bvh-morton-bits <30|63>, --bvh-treelets <0|1>, --bvh-treelet-size <n>,
+//               --bvh-pack-spheres <leaf size>, --accel <tree|linear|wide4|wide8>, --simd <0|1>, --spheres <n>,
+//               --packets <0|4|8|16>, --integrator <recursive|iterative|wavefront>, --wavefront-size <paths>,
+//               --roulette-depth <rays>, --noise-threshold <error>, --min-samples <n>, --max-samples <n>,
+//               --sampler <independent|stratified|halton|sobol|bluenoise>, --reference <png>,
+//               --progressive <0|1>, --time-budget <seconds>, --target-error <error>,
+//               --checkpoint <path>, --checkpoint-interval <seconds>, --resume <0|1>, --cost-maps <0|1>,
+//               --trace <json>, --png-level <0-9>
+void parse_options(int argc, char* argv[], AppOptions& options)
+{
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--threads") == 0 && has_value)
+            options.render.thread_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--tile") == 0 && has_value)
+            options.render.tile_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && has_value)
+            options.render.seed = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--spp") == 0 && has_value)
+            options.render.samples_per_pixel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--depth") == 0 && has_value)
+            options.render.max_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bvh") == 0 && has_value) {
+            const char* method = argv[++i];
+            if (strcmp(method, "sah") == 0)
+                options.bvh.split_method = BvhSplitMethod::Sah;
+            else if (strcmp(method, "morton") == 0)
+                options.bvh.split_method = BvhSplitMethod::Morton;
+            else
+                options.bvh.split_method = BvhSplitMethod::Median;
+        }
+        else if (strcmp(argv[i], "--bvh-quality") == 0 && has_value) {
+            const char* quality = argv[++i];
+            if (strcmp(quality, "fast") == 0)
+                options.bvh.set_quality(BvhBuildQuality::Fast);
+            else if (strcmp(quality, "medium") == 0)
+                options.bvh.set_quality(BvhBuildQuality::Medium);
+            else
+                options.bvh.set_quality(BvhBuildQuality::High);
+        }
+        else if (strcmp(argv[i], "--bvh-morton-bits") == 0 && has_value)
+            options.bvh.morton_bits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bvh-treelets") == 0 && has_value)
+            options.bvh.treelet_refinement = atoi(argv[++i]) != 0;
+        else if (strcmp(argv[i], "--bvh-treelet-size") == 0 && has_value)
+            options.bvh.treelet_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bvh-pack-spheres") == 0 && has_value) {
+            options.bvh.max_leaf_size = atoi(argv[++i]);
+            options.bvh.pack_spheres = options.bvh.max_leaf_size > 1;
+        }
+        else if (strcmp(argv[i], "--bvh-bins") == 0 && has_value)
+            options.bvh.bin_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bvh-leaf") == 0 && has_value)
+            options.bvh.max_leaf_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bvh-traversal-cost") == 0 && has_value)
+            options.bvh.traversal_cost = static_cast<float>(atof(argv[++i]));
+        else if (strcmp(argv[i], "--accel") == 0 && has_value) {
+            const char* accel = argv[++i];
+            if (strcmp(accel, "tree") == 0)
+                options.accel = AccelKind::Tree;
+            else if (strcmp(accel, "wide4") == 0)
+                options.accel = AccelKind::Wide4;
+            else if (strcmp(accel, "wide8") == 0)
+                options.accel = AccelKind::Wide8;
+            else
+                options.accel = AccelKind::Linear;
+        }
+        else if (strcmp(argv[i], "--simd") == 0 && has_value)
+            options.simd = atoi(argv[++i]) != 0;
+        else if (strcmp(argv[i], "--spheres") == 0 && has_value)
+            options.sphere_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--integrator") == 0 && has_value) {
+            const char* integrator = argv[++i];
+            if (strcmp(integrator, "wavefront") == 0)
+                options.render.integrator = Integrator::Wavefront;
+            else if (strcmp(integrator, "iterative") == 0)
+                options.render.integrator = Integrator::Iterative;
+            else
+                options.render.integrator = Integrator::Recursive;
+        }
+        else if (strcmp(argv[i], "--wavefront-size") == 0 && has_value)
+            options.render.wavefront_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--roulette-depth") == 0 && has_value)
+            options.render.roulette_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sampler") == 0 && has_value) {
+            const char* sampler = argv[++i];
+            if (strcmp(sampler, "stratified") == 0)
+                options.render.sampler = SamplerType::Stratified;
+            else if (strcmp(sampler, "halton") == 0)
+                options.render.sampler = SamplerType::Halton;
+            else if (strcmp(sampler, "sobol") == 0)
+                options.render.sampler = SamplerType::Sobol;
+            else if (strcmp(sampler, "bluenoise") == 0)
+                options.render.sampler = SamplerType::BlueNoise;
+            else
+                options.render.sampler = SamplerType::Independent;
+        }
+        else if (strcmp(argv[i], "--progressive") == 0 && has_value)
+            options.render.progressive = atoi(argv[++i]) != 0;
+        else if (strcmp(argv[i], "--time-budget") == 0 && has_value) {
+            options.render.time_budget = static_cast<float>(atof(argv[++i]));
+            options.render.progressive = true;
+        }
+        else if (strcmp(argv[i], "--target-error") == 0 && has_value) {
+            options.render.target_error = static_cast<float>(atof(argv[++i]));
+            options.render.progressive = true;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0 && has_value) {
+            options.render.checkpoint_path = argv[++i];
+            options.render.progressive = true;
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0 && has_value)
+            options.render.checkpoint_interval = static_cast<float>(atof(argv[++i]));
+        else if (strcmp(argv[i], "--resume") == 0 && has_value)
+            options.render.resume = atoi(argv[++i]) != 0;
+        else if (strcmp(argv[i], "--cost-maps") == 0 && has_value)
+            options.render.cost_maps = atoi(argv[++i]) != 0;
+        else if (strcmp(argv[i], "--png-level") == 0 && has_value)
+            options.png.compression_level = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0 && has_value)
+            options.trace = argv[++i];
+        else if (strcmp(argv[i], "--reference") == 0 && has_value)
+            options.reference = argv[++i];
+        else if (strcmp(argv[i], "--noise-threshold") == 0 && has_value)
+            options.render.noise_threshold = static_cast<float>(atof(argv[++i]));
+        else if (strcmp(argv[i], "--min-samples") == 0 && has_value)
+            options.render.min_samples = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-samples") == 0 && has_value)
+            options.render.max_samples = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--packets") == 0 && has_value) {
+            int size = atoi(argv[++i]);
+            if (size == 4 || size == 8 || size == 16)
+                options.render.packet_size = size;
+            else if (size != 0)
+                std::cerr << "Packet size must be 4, 8 or 16, tracing single rays.\n";
+        }
+        else
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+    }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 
     // Image
     /*const auto aspect_ratio = 16.0 / 9.0;
@@ -89,14 +258,55 @@ int main() {
     const auto aspect_ratio = 16.0 / 9.0;
     const int image_width = 400;
     const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 100;
-    const int max_depth = 20;
+    AppOptions options;
+    options.render.samples_per_pixel = 100;
+    options.render.max_depth = 20;
+    parse_options(argc, argv, options);
+    if (!options.trace.empty())
+        enable_tracing(options.trace);
+    if (!options.simd)
+        SphereSoA::set_simd_width(1);
+
+    // Shared by the BVH build and the renderer
+    ThreadPool pool(options.render.thread_count);
+    options.bvh.pool = &pool;
+    options.png.pool = &pool;
 
     // World
     //HittableList world;
-    HittableList world = random_scene();
-    std::vector<shared_ptr<Hittable>> objects = world.objects;
-    BvhNode root(objects, 0, objects.size(), 0, 0);
+    MaterialTable materials;
+    HittableList world = options.sphere_count > 0 ? spheres_scene(options.sphere_count, materials)
+        : random_scene(materials);
+    auto build_start = std::chrono::steady_clock::now();
+    BvhNode root(world, 0, 0, options.bvh);
+    // The tree holds its own references; without this the spheres copied into groups stay alive
+    world.clear();
+    std::cerr << "BVH built in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count()
+        << " s\n";
+    std::cerr << "BVH SAH cost: " << root.sah_cost(options.bvh) << "\n";
+    if (options.bvh.pack_spheres)
+        std::cerr << "Sphere groups: " << SphereSoA::simd_width() << " spheres per test\n";
+    std::unique_ptr<Hittable> flattened;
+    switch (options.accel) {
+    case AccelKind::Linear:
+        flattened.reset(new LinearBvh(root, 0, 0));
+        break;
+    case AccelKind::Wide4: {
+        auto bvh4 = new Bvh4(root, 0, 0, options.simd);
+        std::cerr << "BVH4: " << bvh4->node_count() << " nodes, " << bvh4->kernel_name() << " box tests\n";
+        flattened.reset(bvh4);
+        break;
+    }
+    case AccelKind::Wide8: {
+        auto bvh8 = new Bvh8(root, 0, 0, options.simd);
+        std::cerr << "BVH8: " << bvh8->node_count() << " nodes, " << bvh8->kernel_name() << " box tests\n";
+        flattened.reset(bvh8);
+        break;
+    }
+    case AccelKind::Tree:
+        break;
+    }
+    const Hittable& accel = flattened ? *flattened : static_cast<const Hittable&>(root);
 
     //auto material_ground = make_shared<Lambertian>(Eigen::Vector3f(0.8, 0.8, 0.0));
     //auto material_center = make_shared<Lambertian>(Eigen::Vector3f(0.1, 0.2, 0.5));
@@ -128,22 +338,32 @@ int main() {
 
     std::cout << image_width << " " << image_height << "\n";
     Image img(image_width, image_height);
-    float scale = 1.0 / samples_per_pixel;
-    // Ⱦʱͼƽϵԭͼ
-    for (int j = image_height - 1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            Eigen::Vector3f pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                float u = (i + random_float()) / (image_width);
-                float v = (j + random_float()) / (image_height);
-                Ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, root, max_depth);
-            }
-            pixel_color = gamma_correction(scale * pixel_color, 2.0);
-            img.setPixel(i, j, pixel_color);
-        }
+    Renderer renderer(options.render, pool);
+    // Progressive renders replace the image after every pass, so a killed job still leaves the last one
+    renderer.render(accel, materials, cam, img, [&](Image& pass_img, int samples_per_pixel) {
+        if (!pass_img.save_atomically("test", options.png))
+            std::cerr << "Cannot write the image of the " << samples_per_pixel << " samples per pixel pass.\n";
+    });
+#ifndef RT_NO_STATS
+    const TraversalStats& stats = renderer.get_traversal_stats();
+    std::cerr << "\nBVH traversal: " << stats.nodes_per_query() << " nodes, "
+        << stats.primitives_per_query() << " primitives per ray";
+#endif
+    if (!img.save_atomically("test", options.png))
+        std::cerr << "\nCannot write output/test.png";
+    if (!options.reference.empty()) {
+        float rmse = rmse_against(img, options.reference);
+        if (rmse < 0)
+            std::cerr << "\nCannot compare with " << options.reference << "\n";
+        else
+            std::cerr << "\nRMSE against " << options.reference << ": " << rmse;
+    }
+    const std::vector<uint32_t>& sample_counts = renderer.get_sample_counts();
+    if (!sample_counts.empty()) {
+        std::vector<float> heat(sample_counts.begin(), sample_counts.end());
+        make_heatmap(heat, image_width, image_height).save("test_samples");
     }
-    img.save("test");
+    if (options.render.cost_maps)
+        save_cost_maps(renderer, image_width, image_height);
     std::cerr << "\nDone.\n";
 }
\ No newline at end of file
@@ -12,21 +12,28 @@ public:
     vec3f min() const { return minimum; }
     vec3f max() const { return maximum; }
 
+    vec3f centroid() const { return 0.5f * (minimum + maximum); }
+
+    float surface_area() const {
+        vec3f d = maximum - minimum;
+        return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
     bool hit(const Ray& r, float t_min, float t_max) const {
+        return hit(TraversalRay(r), t_min, t_max);
+    }
+
+    // Slab test without branches: the sign of the direction selects the entry and exit planes
+    bool hit(const TraversalRay& r, float t_min, float t_max) const {
         for (int a = 0; a < 3; a++) {
-            auto invD = 1.0f / r.direction()[a];
-            auto t0 = (min()[a] - r.start()[a]) * invD;
-            auto t1 = (max()[a] - r.start()[a]) * invD;
-            if (invD < 0.0f)
-                std::swap(t0, t1);
+            float t0 = ((r.sign[a] ? maximum : minimum)[a] - r.origin[a]) * r.inv_direction[a];
+            float t1 = ((r.sign[a] ? minimum : maximum)[a] - r.origin[a]) * r.inv_direction[a];
             // ǰά½ʱ֪ĽʱбȽ
             t_min = t0 > t_min ? t0 : t_min;
             t_max = t1 < t_max ? t1 : t_max;
-            // ֻҪ֤άµĽʱСάµ뿪ʱ伴
-            if (t_max <= t_min)
-                return false;
         }
-        return true;
+        // ֻҪ֤άµĽʱСάµ뿪ʱ伴
+        return t_min < t_max;
     }
 
     Aabb operator&(const Aabb box)
@@ -42,6 +49,17 @@ public:
         return Aabb(_min, _max);
     }
 
+    // In-place union, cheaper than operator& in build loops
+    void grow(const Aabb& box) {
+        minimum = minimum.cwiseMin(box.minimum);
+        maximum = maximum.cwiseMax(box.maximum);
+    }
+
+    void grow(const vec3f& p) {
+        minimum = minimum.cwiseMin(p);
+        maximum = maximum.cwiseMax(p);
+    }
+
     vec3f minimum;
     vec3f maximum;
 };
@@ -1,6 +1,11 @@
 #include "bvh.h"
+#include "../objects/sphere_soa.h"
+#include "../utils/trace.h"
 
+#include <algorithm>
+#include <cfloat>
 #include <iostream>
+#include <unordered_map>
 
 bool BvhNode::bounding_box(float time0, float time1, Aabb& output_box) const {
     output_box = box;
@@ -8,84 +13,819 @@ bool BvhNode::bounding_box(float time0, float time1, Aabb& output_box) const {
 }
 
 bool BvhNode::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const {
-    if (!box.hit(r, t_min, t_max))
+    TraversalStats stats;
+    stats.queries = 1;
+    bool hit_anything = hit_node(TraversalRay(r), r, t_min, t_max, rec, stats);
+    RT_STAT(thread_traversal_stats() += stats);
+    return hit_anything;
+}
+
+// The traversal data is computed once per ray, child nodes are entered with a direct call.
+// The child nearer to the ray origin is visited first, the far one is then tested against
+// the closest hit so far and skipped when its box starts beyond it.
+bool BvhNode::hit_node(const TraversalRay& ray, const Ray& r, float t_min, float t_max, HitRecord& rec,
+    TraversalStats& stats) const {
+    stats.nodes_visited++;
+    if (!box.hit(ray, t_min, t_max))
         return false;
 
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    bool right_first = (ray.sign[axis] != 0) == left_is_lower;
+    bool hit_first = hit_child(right_first, ray, r, t_min, t_max, rec, stats);
+    bool hit_second = left != right && hit_child(!right_first, ray, r, t_min, hit_first ? rec.t : t_max, rec, stats);
     // rec.t ָеHittableʱ䣻еHittablerec
     // ֻtminrec.tһʱ
 
-    return hit_left || hit_right;
+    return hit_first || hit_second;
 }
 
-inline bool box_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int axis) {
-    Aabb box_a;
-    Aabb box_b;
+inline bool BvhNode::hit_child(bool right_child, const TraversalRay& ray, const Ray& r, float t_min, float t_max,
+    HitRecord& rec, TraversalStats& stats) const {
+    const shared_ptr<Hittable>& child = right_child ? right : left;
+    if (right_child ? right_is_node : left_is_node)
+        return static_cast<const BvhNode*>(child.get())->hit_node(ray, r, t_min, t_max, rec, stats);
+    stats.primitives_tested++;
+    return child->hit(r, t_min, t_max, rec);
+}
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
-    if (axis == 0)
-        return box_a.min().x() < box_b.min().x();
-    else if (axis == 1)
-        return box_a.min().y() < box_b.min().y();
-    else
-        return box_a.min().z() < box_b.min().z();
+bool BvhNode::occluded(const Ray& r, float t_min, float t_max) const {
+    return occluded_node(TraversalRay(r), r, t_min, t_max);
+}
+
+// Any hit ends the query, so the range never shrinks. The nearer child is still tried first,
+// it is the more likely one to block the ray.
+bool BvhNode::occluded_node(const TraversalRay& ray, const Ray& r, float t_min, float t_max) const {
+    if (!box.hit(ray, t_min, t_max))
+        return false;
+
+    auto child_occluded = [&](bool right_child) {
+        const shared_ptr<Hittable>& child = right_child ? right : left;
+        if (right_child ? right_is_node : left_is_node)
+            return static_cast<const BvhNode*>(child.get())->occluded_node(ray, r, t_min, t_max);
+        return child->occluded(r, t_min, t_max);
+    };
+    bool right_first = (ray.sign[axis] != 0) == left_is_lower;
+    return child_occluded(right_first) || (left != right && child_occluded(!right_first));
+}
+
+void BvhNode::update_traversal_info(const Aabb& box_left, const Aabb& box_right)
+{
+    left_is_node = dynamic_cast<const BvhNode*>(left.get()) != nullptr;
+    right_is_node = dynamic_cast<const BvhNode*>(right.get()) != nullptr;
+
+    vec3f separation = box_right.centroid() - box_left.centroid();
+    vec3f distance = separation.cwiseAbs();
+    int a = 0;
+    if (distance.y() > distance[a]) a = 1;
+    if (distance.z() > distance[a]) a = 2;
+    axis = static_cast<uint8_t>(a);
+    left_is_lower = separation[a] >= 0.0f;
+}
+
+// Object bounds are computed once and travel with the object id, so partitioning
+// reads and writes one array sequentially instead of gathering through indices.
+struct BvhPrimitiveRef {
+    Aabb box;
+    vec3f centroid;
+    uint32_t id; // index of the object relative to the start of the build range
+};
+
+// Number of chunks a range of count objects is split into for parallel loops
+static size_t chunk_count(const BvhBuildOptions& options, size_t count)
+{
+    if (options.pool == nullptr || options.pool->size() == 1)
+        return 1;
+    size_t grain = std::max<size_t>(options.parallel_grain, 1);
+    size_t chunks = std::min(count / grain, static_cast<size_t>(options.pool->size()) * 4);
+    return std::max<size_t>(chunks, 1);
+}
+
+// Calls body(chunk_begin, chunk_end, chunk) for every chunk of [begin, end), as pool tasks if there are several
+template <class Body>
+static void run_chunks(const BvhBuildOptions& options, size_t begin, size_t end, size_t chunks, const Body& body)
+{
+    if (chunks == 1) {
+        body(begin, end, 0);
+        return;
+    }
+    TaskGroup tasks(*options.pool);
+    size_t count = end - begin;
+    for (size_t c = 0; c < chunks; c++) {
+        size_t chunk_begin = begin + count * c / chunks;
+        size_t chunk_end = begin + count * (c + 1) / chunks;
+        tasks.run([&body, chunk_begin, chunk_end, c]() { body(chunk_begin, chunk_end, c); });
+    }
+    tasks.wait();
+}
+
+// State shared by every node of one build
+struct BvhBuildContext {
+    BvhBuildContext(
+        const std::vector<shared_ptr<Hittable>>& objects,
+        size_t start, size_t end, float time0, float time1,
+        const BvhBuildOptions& options)
+        : objects(objects), first(start), time0(time0), time1(time1), options(options)
+    {
+        size_t count = end - start;
+        refs.resize(count);
+        run_chunks(options, 0, count, chunk_count(options, count), [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; i++) {
+                if (!objects[start + i]->bounding_box(time0, time1, refs[i].box))
+                    std::cerr << "No bounding box in bvh_node constructor.\n";
+                refs[i].centroid = refs[i].box.centroid();
+                refs[i].id = static_cast<uint32_t>(i);
+            }
+        });
+    }
+
+    const shared_ptr<Hittable>& object(size_t position) const { return objects[first + refs[position].id]; }
+
+    const std::vector<shared_ptr<Hittable>>& objects;
+    size_t first;                  // objects[first] has local id 0
+    std::vector<BvhPrimitiveRef> refs; // partitioned in place as the tree is built
+    std::vector<uint64_t> morton_codes; // Morton: code of every reference, sorted
+    float time0, time1;
+    const BvhBuildOptions& options;
+};
+
+// Spreads the low 21 bits of v so that two zero bits follow every bit
+static uint64_t expand_bits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+struct MortonKey {
+    uint64_t code;
+    uint32_t position; // index into BvhBuildContext::refs before sorting
+};
+
+// Stable LSD radix sort on the low key_bits bits of the codes, 8 bits per pass.
+// Every chunk counts its digits, then scatters to the offsets reserved for it,
+// so the result does not depend on the number of chunks.
+static void radix_sort(std::vector<MortonKey>& keys, int key_bits, const BvhBuildOptions& options)
+{
+    const int digit_bits = 8;
+    const size_t radix = static_cast<size_t>(1) << digit_bits;
+    size_t count = keys.size();
+    size_t chunks = chunk_count(options, count);
+    std::vector<MortonKey> scratch(count);
+    std::vector<size_t> offsets(chunks * radix);
+
+    for (int shift = 0; shift < key_bits; shift += digit_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        run_chunks(options, 0, count, chunks, [&](size_t b, size_t e, size_t c) {
+            size_t* histogram = &offsets[c * radix];
+            for (size_t i = b; i < e; i++)
+                histogram[(keys[i].code >> shift) & (radix - 1)]++;
+        });
+
+        // Exclusive prefix sum, digit by digit and chunk by chunk within a digit
+        size_t sum = 0;
+        for (size_t digit = 0; digit < radix; digit++) {
+            for (size_t c = 0; c < chunks; c++) {
+                size_t n = offsets[c * radix + digit];
+                offsets[c * radix + digit] = sum;
+                sum += n;
+            }
+        }
+        run_chunks(options, 0, count, chunks, [&](size_t b, size_t e, size_t c) {
+            size_t* offset = &offsets[c * radix];
+            for (size_t i = b; i < e; i++)
+                scratch[offset[(keys[i].code >> shift) & (radix - 1)]++] = keys[i];
+        });
+        keys.swap(scratch);
+    }
+}
+
+// Sorts the object references along a Morton curve through the centroid bounds
+static void sort_by_morton(BvhBuildContext& context)
+{
+    const BvhBuildOptions& options = context.options;
+    size_t count = context.refs.size();
+    size_t chunks = chunk_count(options, count);
+
+    std::vector<Aabb> chunk_bounds(chunks);
+    run_chunks(options, 0, count, chunks, [&](size_t b, size_t e, size_t c) {
+        Aabb bounds(context.refs[b].centroid, context.refs[b].centroid);
+        for (size_t i = b + 1; i < e; i++)
+            bounds.grow(context.refs[i].centroid);
+        chunk_bounds[c] = bounds;
+    });
+    Aabb centroid_bounds = chunk_bounds[0];
+    for (size_t c = 1; c < chunks; c++)
+        centroid_bounds.grow(chunk_bounds[c]);
+
+    int axis_bits = options.morton_bits >= 63 ? 21 : 10;
+    uint64_t max_cell = (static_cast<uint64_t>(1) << axis_bits) - 1;
+    double scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        double extent = centroid_bounds.maximum[axis] - centroid_bounds.minimum[axis];
+        scale[axis] = extent > 0 ? (max_cell + 1) / extent : 0.0;
+    }
+
+    std::vector<MortonKey> keys(count);
+    run_chunks(options, 0, count, chunks, [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; i++) {
+            uint64_t code = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                double offset = (context.refs[i].centroid[axis] - centroid_bounds.minimum[axis]) * scale[axis];
+                uint64_t cell = std::min(static_cast<uint64_t>(std::max(offset, 0.0)), max_cell);
+                code |= expand_bits(cell) << (2 - axis);
+            }
+            keys[i].code = code;
+            keys[i].position = static_cast<uint32_t>(i);
+        }
+    });
+
+    radix_sort(keys, 3 * axis_bits, options);
+
+    std::vector<BvhPrimitiveRef> sorted(count);
+    context.morton_codes.resize(count);
+    run_chunks(options, 0, count, chunks, [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; i++) {
+            sorted[i] = context.refs[keys[i].position];
+            context.morton_codes[i] = keys[i].code;
+        }
+    });
+    context.refs.swap(sorted);
 }
 
+// Splits a Morton-sorted range at the highest bit in which its codes differ, so every node
+// covers one cell of the implicit octree. Objects sharing a single code are halved.
+static size_t morton_split(const BvhBuildContext& context, size_t begin, size_t end)
+{
+    const uint64_t* codes = context.morton_codes.data();
+    uint64_t difference = codes[begin] ^ codes[end - 1];
+    if (difference == 0)
+        return begin + (end - begin) / 2;
 
-bool box_x_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-    return box_compare(a, b, 0);
+    uint64_t bit = static_cast<uint64_t>(1) << 63;
+    while ((difference & bit) == 0)
+        bit >>= 1;
+    const uint64_t* split = std::partition_point(codes + begin, codes + end,
+        [bit](uint64_t code) { return (code & bit) == 0; });
+    return static_cast<size_t>(split - codes);
 }
 
-bool box_y_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-    return box_compare(a, b, 1);
+// State of the treelet restructuring pass
+struct TreeletContext {
+    TreeletContext(const BvhBuildOptions& options, float time0, float time1)
+        : options(options), time0(time0), time1(time1)
+    {}
+
+    const BvhBuildOptions& options;
+    float time0, time1;
+    std::unordered_map<const BvhNode*, float> costs; // subtree cost of every node refined so far
+};
+
+// Partitions indices [begin, end) along the cheapest SAH bin boundary and returns the split
+// position, or returns end when keeping every object in a single leaf is cheaper.
+static size_t sah_partition(BvhBuildContext& context, size_t begin, size_t end)
+{
+    const BvhBuildOptions& options = context.options;
+    const BvhPrimitiveRef* refs = context.refs.data();
+    size_t count = end - begin;
+
+    size_t chunks = chunk_count(options, count);
+
+    // Bounds of the boxes and of the centroids, one partial result per chunk
+    std::vector<Aabb> chunk_bounds(chunks), chunk_centroid_bounds(chunks);
+    run_chunks(options, begin, end, chunks, [&](size_t b, size_t e, size_t c) {
+        Aabb box = refs[b].box;
+        Aabb centroid_box(refs[b].centroid, refs[b].centroid);
+        for (size_t i = b + 1; i < e; i++) {
+            box.grow(refs[i].box);
+            centroid_box.grow(refs[i].centroid);
+        }
+        chunk_bounds[c] = box;
+        chunk_centroid_bounds[c] = centroid_box;
+    });
+    Aabb bounds = chunk_bounds[0];
+    Aabb centroid_bounds = chunk_centroid_bounds[0];
+    for (size_t c = 1; c < chunks; c++) {
+        bounds.grow(chunk_bounds[c]);
+        centroid_bounds.grow(chunk_centroid_bounds[c]);
+    }
+
+    struct Bin {
+        Aabb box;
+        size_t count;
+    };
+    const int max_bins = 64;
+    const int bin_count = std::min(std::max(options.bin_count, 2), max_bins);
+    vec3f bin_scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bounds.maximum[axis] - centroid_bounds.minimum[axis];
+        bin_scale[axis] = extent > 0 ? bin_count / extent : 0.0f;
+    }
+    auto bin_index = [&](const vec3f& centroid, int axis) {
+        int b = static_cast<int>((centroid[axis] - centroid_bounds.minimum[axis]) * bin_scale[axis]);
+        return std::min(std::max(b, 0), bin_count - 1);
+    };
+
+    // Bin every object on the three axes in a single pass. Min, max and counts are exact,
+    // so merging the per-chunk bins gives the same result as a serial pass.
+    struct BinSet {
+        Bin bins[3][max_bins];
+    };
+    bool splittable[3];
+    for (int axis = 0; axis < 3; axis++)
+        splittable[axis] = centroid_bounds.maximum[axis] > centroid_bounds.minimum[axis];
+    auto bin_range = [&](size_t b, size_t e, BinSet& set) {
+        for (int axis = 0; axis < 3; axis++)
+            for (int k = 0; k < bin_count; k++)
+                set.bins[axis][k].count = 0;
+        for (size_t i = b; i < e; i++) {
+            const Aabb& box = refs[i].box;
+            for (int axis = 0; axis < 3; axis++) {
+                if (!splittable[axis])
+                    continue;
+                Bin& bin = set.bins[axis][bin_index(refs[i].centroid, axis)];
+                if (bin.count++ == 0)
+                    bin.box = box;
+                else
+                    bin.box.grow(box);
+            }
+        }
+    };
+
+    BinSet binned;
+    if (chunks == 1) {
+        bin_range(begin, end, binned);
+    }
+    else {
+        std::vector<BinSet> chunk_bins(chunks);
+        run_chunks(options, begin, end, chunks, [&](size_t b, size_t e, size_t c) { bin_range(b, e, chunk_bins[c]); });
+        binned = chunk_bins[0];
+        for (size_t c = 1; c < chunks; c++) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (int k = 0; k < bin_count; k++) {
+                    Bin& bin = binned.bins[axis][k];
+                    const Bin& other = chunk_bins[c].bins[axis][k];
+                    if (other.count == 0)
+                        continue;
+                    if (bin.count == 0)
+                        bin.box = other.box;
+                    else
+                        bin.box.grow(other.box);
+                    bin.count += other.count;
+                }
+            }
+        }
+    }
+    auto& bins = binned.bins;
+
+    float best_cost = FLT_MAX;
+    int best_axis = -1, best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (!splittable[axis])
+            continue;
+
+        // Sweep from the right to get the area and count right of every boundary
+        float right_area[max_bins];
+        size_t right_count[max_bins];
+        Aabb right_box;
+        size_t right_total = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            const Bin& bin = bins[axis][b];
+            if (bin.count > 0) {
+                right_box = right_total == 0 ? bin.box : right_box & bin.box;
+                right_total += bin.count;
+            }
+            right_area[b] = right_total > 0 ? right_box.surface_area() : 0.0f;
+            right_count[b] = right_total;
+        }
+
+        // Then sweep from the left, boundary b separates bins [0, b) from [b, bin_count)
+        Aabb left_box;
+        size_t left_total = 0;
+        for (int b = 1; b < bin_count; b++) {
+            const Bin& bin = bins[axis][b - 1];
+            if (bin.count > 0) {
+                left_box = left_total == 0 ? bin.box : left_box & bin.box;
+                left_total += bin.count;
+            }
+            if (left_total == 0 || right_count[b] == 0)
+                continue;
+            float cost = options.traversal_cost + options.intersection_cost
+                * (left_box.surface_area() * left_total + right_area[b] * right_count[b])
+                / bounds.surface_area();
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    bool fits_leaf = count <= static_cast<size_t>(std::max(options.max_leaf_size, 1));
+    if (best_axis < 0) // every centroid in the same place, no bin boundary separates them
+        return fits_leaf ? end : begin + count / 2;
+    // A packed leaf tests its spheres lane_padding at a time
+    size_t leaf_tests = options.pack_spheres ? (count + SphereSoA::lane_padding - 1) / SphereSoA::lane_padding : count;
+    if (fits_leaf && options.intersection_cost * leaf_tests <= best_cost)
+        return end;
+
+    BvhPrimitiveRef* first = context.refs.data();
+    BvhPrimitiveRef* middle = std::partition(first + begin, first + end,
+        [&](const BvhPrimitiveRef& ref) { return bin_index(ref.centroid, best_axis) < best_split; });
+    return static_cast<size_t>(middle - first);
 }
 
-bool box_z_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-    return box_compare(a, b, 2);
+void BvhNode::make_leaf(BvhBuildContext& context, const ArenaAllocator<BvhNode>& allocator, size_t begin, size_t end)
+{
+    size_t object_span = end - begin;
+    if (context.options.pack_spheres && object_span > 1) {
+        std::vector<shared_ptr<Hittable>> objects;
+        for (size_t i = begin; i < end; i++)
+            objects.push_back(context.object(i));
+        objects = SphereSoA::pack(objects);
+        if (objects.size() <= 2) {
+            left = objects.front();
+            right = objects.back();
+        }
+        else {
+            auto mid = objects.size() / 2;
+            auto left_list = std::allocate_shared<BvhLeafList>(allocator);
+            auto right_list = std::allocate_shared<BvhLeafList>(allocator);
+            left_list->objects.assign(objects.begin(), objects.begin() + mid);
+            right_list->objects.assign(objects.begin() + mid, objects.end());
+            left = left_list;
+            right = right_list;
+        }
+        return;
+    }
+
+    if (object_span == 1) {
+        left = right = context.object(begin);
+    }
+    else if (object_span == 2) {
+        left = context.object(begin);
+        right = context.object(begin + 1);
+    }
+    else {
+        // Both halves are tested once the leaf box is hit, as if the leaf held one list
+        auto mid = begin + object_span / 2;
+        auto left_list = std::allocate_shared<BvhLeafList>(allocator);
+        auto right_list = std::allocate_shared<BvhLeafList>(allocator);
+        for (size_t i = begin; i < mid; i++)
+            left_list->add(context.object(i));
+        for (size_t i = mid; i < end; i++)
+            right_list->add(context.object(i));
+        left = left_list;
+        right = right_list;
+    }
 }
 
 BvhNode::BvhNode(
     const std::vector<shared_ptr<Hittable>>& src_objects,
-    size_t start, size_t end, float time0, float time1
+    size_t start, size_t end, float time0, float time1,
+    const BvhBuildOptions& options
 ) {
-    std::vector<shared_ptr<Hittable>> objects = src_objects; // Create a modifiable array of the source scene objects
+    RT_TRACE_SCOPE("bvh_build", "objects", static_cast<int64_t>(end - start));
+    BvhBuildContext context(src_objects, start, end, time0, time1, options);
+    if (options.split_method == BvhSplitMethod::Morton)
+        sort_by_morton(context);
+    build(context, ArenaAllocator<BvhNode>(make_shared<Arena>()), 0, end - start);
 
-    int axis = random_int(0, 2);
-    auto comparator = (axis == 0) ? box_x_compare
-        : (axis == 1) ? box_y_compare
-        : box_z_compare;
+    if (options.treelet_refinement) {
+        RT_TRACE_SCOPE("bvh_treelets");
+        TreeletContext treelets(options, time0, time1);
+        size_t object_count;
+        refine_treelets(treelets, object_count);
+    }
+}
 
-    size_t object_span = end - start;
+void BvhNode::build(BvhBuildContext& context, const ArenaAllocator<BvhNode>& allocator, size_t begin, size_t end)
+{
+    ThreadPool* pool = context.options.pool;
+    std::unique_ptr<TaskGroup> tasks; // created when a child subtree is built in parallel
 
-    if (object_span == 1) {
-        left = right = objects[start];
+    auto make_child = [&](size_t child_begin, size_t child_end) {
+        shared_ptr<BvhNode> child = std::allocate_shared<BvhNode>(allocator);
+        if (pool != nullptr && child_end - child_begin >= context.options.parallel_grain) {
+            if (!tasks)
+                tasks.reset(new TaskGroup(*pool));
+            // Every task allocates from its own arena, arenas are not shared between threads
+            BvhNode* node = child.get();
+            tasks->run([&context, node, child_begin, child_end]() {
+                RT_TRACE_SCOPE("bvh_build_subtree", "objects", static_cast<int64_t>(child_end - child_begin));
+                node->build(context, ArenaAllocator<BvhNode>(make_shared<Arena>()), child_begin, child_end);
+            });
+        }
+        else {
+            child->build(context, allocator, child_begin, child_end);
+        }
+        return child;
+    };
+
+    size_t object_span = end - begin;
+    // SAH weighs packed leaves itself, the other methods stop splitting at max_leaf_size objects
+    size_t pack_limit = context.options.split_method == BvhSplitMethod::Sah ? 2
+        : static_cast<size_t>(std::max(context.options.max_leaf_size, 1));
+    bool pack_leaf = context.options.pack_spheres && object_span > 1 && object_span <= pack_limit;
+
+    if (pack_leaf) {
+        make_leaf(context, allocator, begin, end);
     }
-    else if (object_span == 2) {
-        if (comparator(objects[start], objects[start + 1])) {
-            left = objects[start];
-            right = objects[start + 1];
+    else if (context.options.split_method == BvhSplitMethod::Sah && object_span > 2) {
+        size_t mid = sah_partition(context, begin, end);
+        if (mid == end) {
+            make_leaf(context, allocator, begin, end);
         }
         else {
-            left = objects[start + 1];
-            right = objects[start];
+            left = make_child(begin, mid);
+            right = make_child(mid, end);
         }
     }
+    else if (context.options.split_method == BvhSplitMethod::Morton && object_span > 2) {
+        size_t mid = morton_split(context, begin, end);
+        left = make_child(begin, mid);
+        right = make_child(mid, end);
+    }
     else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
+        // The axis depends only on the seed and the range, not on the order nodes are built in
+        uint64_t key = (static_cast<uint64_t>(begin) << 32) ^ static_cast<uint64_t>(end);
+        int axis = static_cast<int>(splitmix64(context.options.seed ^ splitmix64(key)) % 3);
+        auto comparator = [axis](const BvhPrimitiveRef& a, const BvhPrimitiveRef& b) {
+            return a.box.minimum[axis] < b.box.minimum[axis];
+        };
 
-        auto mid = start + object_span / 2;
-        left = make_shared<BvhNode>(objects, start, mid, time0, time1);
-        right = make_shared<BvhNode>(objects, mid, end, time0, time1);
+        if (object_span == 1) {
+            left = right = context.object(begin);
+        }
+        else if (object_span == 2) {
+            if (comparator(context.refs[begin], context.refs[begin + 1])) {
+                left = context.object(begin);
+                right = context.object(begin + 1);
+            }
+            else {
+                left = context.object(begin + 1);
+                right = context.object(begin);
+            }
+        }
+        else {
+            // Only the halves matter, both children order their own range again
+            auto mid = begin + object_span / 2;
+            BvhPrimitiveRef* first = context.refs.data();
+            std::nth_element(first + begin, first + mid, first + end, comparator);
+            left = make_child(begin, mid);
+            right = make_child(mid, end);
+        }
     }
 
+    if (tasks)
+        tasks->wait();
+
     Aabb box_left, box_right;
 
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right->bounding_box(time0, time1, box_right)
+    if (!left->bounding_box(context.time0, context.time1, box_left)
+        || !right->bounding_box(context.time0, context.time1, box_right)
         )
         std::cerr << "No bounding box in bvh_node constructor.\n";
 
     box = box_left & box_right;
-}
\ No newline at end of file
+    update_traversal_info(box_left, box_right);
+}
+
+float BvhNode::sah_cost(const BvhBuildOptions& options) const
+{
+    float root_area = box.surface_area();
+    float cost = subtree_cost(options);
+    return root_area > 0 ? cost / root_area : cost;
+}
+
+// Unnormalized SAH cost: every node costs a traversal step weighted by its area,
+// objects below it cost one intersection each, weighted by the area of the box that guards them.
+float BvhNode::subtree_cost(const BvhBuildOptions& options) const
+{
+    float area = box.surface_area();
+    auto child_cost = [&](const shared_ptr<Hittable>& child) {
+        if (auto node = dynamic_cast<const BvhNode*>(child.get()))
+            return node->subtree_cost(options);
+        size_t objects = 1;
+        if (auto list = dynamic_cast<const HittableList*>(child.get()))
+            objects = list->objects.size();
+        return options.intersection_cost * objects * area;
+    };
+
+    float cost = options.traversal_cost * area + child_cost(left);
+    if (right != left)
+        cost += child_cost(right);
+    return cost;
+}
+
+// Objects a leaf child stands for
+static size_t leaf_object_count(const Hittable* child)
+{
+    if (auto list = dynamic_cast<const HittableList*>(child))
+        return list->objects.size();
+    return 1;
+}
+
+// Cost of a subtree, recorded by the refinement pass or else computed from scratch
+float BvhNode::treelet_cost(const TreeletContext& context) const
+{
+    auto found = context.costs.find(this);
+    return found != context.costs.end() ? found->second : subtree_cost(context.options);
+}
+
+// Cost of a child of a node whose box has the given area, a subtree brings its own cost
+float BvhNode::treelet_child_cost(const TreeletContext& context, const shared_ptr<Hittable>& child, float parent_area)
+{
+    if (auto node = dynamic_cast<const BvhNode*>(child.get()))
+        return node->treelet_cost(context);
+    return context.options.intersection_cost * leaf_object_count(child.get()) * parent_area;
+}
+
+// Bottom-up pass: the treelet of every node holding at least treelet_min_objects objects is
+// restructured once its children are final. Smaller subtrees are left as built, they gain little
+// and would dominate the running time. Counts the objects below this node.
+void BvhNode::refine_treelets(TreeletContext& context, size_t& object_count)
+{
+    size_t counts[2];
+    const shared_ptr<Hittable>* children[2] = { &left, &right };
+    for (int k = 0; k < 2; k++) {
+        if (auto node = dynamic_cast<BvhNode*>(children[k]->get()))
+            node->refine_treelets(context, counts[k]);
+        else
+            counts[k] = leaf_object_count(children[k]->get());
+    }
+    object_count = left == right ? counts[0] : counts[0] + counts[1];
+    if (left == right || object_count < context.options.treelet_min_objects)
+        return;
+
+    restructure_treelet(context);
+
+    float area = box.surface_area();
+    context.costs[this] = context.options.traversal_cost * area
+        + treelet_child_cost(context, left, area) + treelet_child_cost(context, right, area);
+}
+
+// Treelet restructuring after Karras and Aila, "Fast Parallel Construction of High-Quality Bounding
+// Volume Hierarchies" (HPG 2013). The treelet grows from this node by opening its largest leaf until
+// it has treelet_size leaves; dynamic programming over the subsets of these leaves then finds the
+// cheapest binary tree over them, which replaces the treelet if it is cheaper. The interior nodes are
+// reused, so the pass allocates nothing.
+void BvhNode::restructure_treelet(TreeletContext& context)
+{
+    const int max_leaves = 8;
+    const BvhBuildOptions& options = context.options;
+    int leaf_limit = std::min(std::max(options.treelet_size, 3), max_leaves);
+
+    shared_ptr<Hittable> leaves[max_leaves];
+    Aabb leaf_boxes[max_leaves];
+    shared_ptr<Hittable> interiors[max_leaves]; // opened nodes below this one
+    int leaf_count = 0, interior_count = 0;
+
+    auto set_leaf = [&](int i, const shared_ptr<Hittable>& child) {
+        leaves[i] = child;
+        if (!child->bounding_box(context.time0, context.time1, leaf_boxes[i]))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+    };
+    set_leaf(leaf_count++, left);
+    set_leaf(leaf_count++, right);
+
+    while (leaf_count < leaf_limit) {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (int i = 0; i < leaf_count; i++) {
+            auto node = dynamic_cast<const BvhNode*>(leaves[i].get());
+            if (node == nullptr || node->left == node->right)
+                continue;
+            float area = leaf_boxes[i].surface_area();
+            if (area > largest_area) {
+                largest_area = area;
+                largest = i;
+            }
+        }
+        if (largest < 0)
+            break;
+        auto node = static_cast<const BvhNode*>(leaves[largest].get());
+        interiors[interior_count++] = leaves[largest];
+        shared_ptr<Hittable> node_left = node->left, node_right = node->right;
+        set_leaf(largest, node_left);
+        set_leaf(leaf_count++, node_right);
+    }
+    if (leaf_count < 3) // two leaves have a single topology
+        return;
+
+    // Area, cost and best split of every subset of the leaves; a subset's own subsets are smaller numbers
+    const int max_subsets = 1 << max_leaves;
+    int subset_count = 1 << leaf_count;
+    Aabb subset_boxes[max_subsets];
+    float areas[max_subsets], costs[max_subsets];
+    int splits[max_subsets];
+
+    // A leaf subtree has a fixed cost, leaf objects cost in proportion to the area of their parent.
+    // objects is zero for every other subset, so the cost of a subset under a parent is branch free.
+    float objects[max_subsets];
+    for (int s = 0; s < subset_count; s++)
+        objects[s] = 0.0f;
+    for (int i = 0; i < leaf_count; i++) {
+        auto subtree = dynamic_cast<const BvhNode*>(leaves[i].get());
+        costs[1 << i] = subtree != nullptr ? subtree->treelet_cost(context) : 0.0f;
+        objects[1 << i] = subtree != nullptr ? 0.0f : static_cast<float>(leaf_object_count(leaves[i].get()));
+    }
+    auto term = [&](int subset, float parent_area) {
+        return costs[subset] + options.intersection_cost * objects[subset] * parent_area;
+    };
+
+    for (int s = 1; s < subset_count; s++) {
+        int lowest = s & -s;
+        int i = 0;
+        while ((lowest >> i) != 1)
+            i++;
+        subset_boxes[s] = s == lowest ? leaf_boxes[i] : subset_boxes[s ^ lowest] & leaf_boxes[i];
+        areas[s] = subset_boxes[s].surface_area();
+        if (s == lowest)
+            continue;
+
+        // Every partition once: the side holding the lowest leaf is enumerated
+        float best = FLT_MAX;
+        int best_split = 0;
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+            if ((p & lowest) == 0)
+                continue;
+            float cost = term(p, areas[s]) + term(s ^ p, areas[s]);
+            if (cost < best) {
+                best = cost;
+                best_split = p;
+            }
+        }
+        costs[s] = options.traversal_cost * areas[s] + best;
+        splits[s] = best_split;
+    }
+
+    int all = subset_count - 1;
+    float area = box.surface_area();
+    float current = options.traversal_cost * area + treelet_child_cost(context, left, area) + treelet_child_cost(context, right, area);
+    if (costs[all] >= current * 0.999f)
+        return;
+
+    // Rebuild top-down, handing out the opened nodes as interior nodes of the new topology
+    struct Pending {
+        BvhNode* node;
+        int subset;
+    };
+    Pending stack[max_leaves];
+    int stack_size = 0, next_interior = 0;
+    stack[stack_size++] = { this, all };
+    while (stack_size > 0) {
+        Pending pending = stack[--stack_size];
+        int parts[2] = { splits[pending.subset], pending.subset ^ splits[pending.subset] };
+        shared_ptr<Hittable> children[2];
+        for (int k = 0; k < 2; k++) {
+            if ((parts[k] & (parts[k] - 1)) == 0) {
+                int i = 0;
+                while ((parts[k] >> i) != 1)
+                    i++;
+                children[k] = leaves[i];
+            }
+            else {
+                children[k] = interiors[next_interior++];
+                stack[stack_size++] = { static_cast<BvhNode*>(children[k].get()), parts[k] };
+            }
+        }
+        pending.node->left = children[0];
+        pending.node->right = children[1];
+        pending.node->box = subset_boxes[pending.subset];
+        pending.node->update_traversal_info(subset_boxes[parts[0]], subset_boxes[parts[1]]);
+        if (pending.node != this)
+            context.costs[pending.node] = costs[pending.subset];
+    }
+}
+
+BvhBuildOptions& BvhBuildOptions::set_quality(BvhBuildQuality quality)
+{
+    switch (quality) {
+    case BvhBuildQuality::Fast:
+        split_method = BvhSplitMethod::Morton;
+        treelet_refinement = false;
+        break;
+    case BvhBuildQuality::Medium:
+        split_method = BvhSplitMethod::Morton;
+        treelet_refinement = true;
+        break;
+    case BvhBuildQuality::High:
+        split_method = BvhSplitMethod::Sah;
+        treelet_refinement = false;
+        break;
+    }
+    return *this;
+}
+
+void add_leaf_primitives(const shared_ptr<Hittable>& child, size_t max_unpacked,
+    std::vector<shared_ptr<Hittable>>& primitives)
+{
+    auto list = dynamic_cast<const BvhLeafList*>(child.get());
+    if (list && list->objects.size() <= max_unpacked)
+        primitives.insert(primitives.end(), list->objects.begin(), list->objects.end());
+    else
+        primitives.push_back(child);
+}
@@ -2,32 +2,116 @@
 #define BVH_H
 
 #include "../utils/global.h"
+#include "../utils/arena.h"
+#include "../utils/thread_pool.h"
+#include "traversal_stats.h"
 
 #include "../ray/hittable.h"
 #include "../ray/hittable_list.h"
 
+enum class BvhSplitMethod {
+    Median, // random axis, split at the median object
+    Sah,    // binned surface area heuristic
+    Morton  // LBVH: objects sorted along a Morton curve, split at the highest differing bit
+};
+
+// Presets trading build time for traversal speed
+enum class BvhBuildQuality {
+    Fast,   // Morton
+    Medium, // Morton, then treelet restructuring
+    High    // SAH
+};
+
+struct BvhBuildOptions {
+    BvhSplitMethod split_method = BvhSplitMethod::Median;
+    int bin_count = 16;             // SAH: buckets per axis, at most 64
+    int max_leaf_size = 4;          // SAH, pack_spheres: largest number of objects kept in one leaf
+    float traversal_cost = 0.125f;  // SAH: cost of visiting a node...
+    float intersection_cost = 1.0f; // ...relative to intersecting one object
+    uint64_t seed = 0;              // Median: determines the split axis of every node
+    int morton_bits = 30;           // Morton: 30 (10 bits per axis) or 63 (21 bits per axis)
+    bool treelet_refinement = false; // reorganize every treelet of up to treelet_size leaves for the lowest SAH cost
+    int treelet_size = 7;           // at most 8
+    size_t treelet_min_objects = 64; // smaller subtrees are not restructured
+    bool pack_spheres = false;      // leaves keep their spheres in one SphereSoA; every split method then
+                                    // stops at max_leaf_size objects
+
+    // When set, subtrees and SAH binning of large ranges run as tasks on the pool.
+    // The tree does not depend on the number of threads.
+    ThreadPool* pool = nullptr;
+    size_t parallel_grain = 16384;  // smallest object range handed to a separate task
+
+    // Selects the split method and refinement of a preset, other options are kept
+    BvhBuildOptions& set_quality(BvhBuildQuality quality);
+};
+
+struct BvhBuildContext;
+struct TreeletContext;
+
+// Half of the objects of a leaf, made by the builder when a leaf holds more than two. Unlike a
+// HittableList that is itself a scene object, flattened BVHs unpack it into their primitives.
+class BvhLeafList : public HittableList {};
 
 class BvhNode : public Hittable {
 public:
-    BvhNode();
+    BvhNode() {}
 
-    BvhNode(const HittableList& list, float time0, float time1)
-        : BvhNode(list.objects, 0, list.objects.size(), time0, time1)
+    BvhNode(const HittableList& list, float time0, float time1,
+        const BvhBuildOptions& options = BvhBuildOptions())
+        : BvhNode(list.objects, 0, list.objects.size(), time0, time1, options)
     {}
 
+    // Builds over src_objects[start, end). The objects are never copied: the builder partitions one
+    // shared array of object references in place and allocates the nodes from a single arena.
     BvhNode(
         const std::vector<shared_ptr<Hittable>>& src_objects,
-        size_t start, size_t end, float time0, float time1);
+        size_t start, size_t end, float time0, float time1,
+        const BvhBuildOptions& options = BvhBuildOptions());
 
     virtual bool hit(
         const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
 
     virtual bool bounding_box(float time0, float time1, Aabb& output_box) const override;
 
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
+
+    // Expected cost of a random ray hitting the root box, as estimated by the surface area heuristic.
+    // Lower is better; use it to compare trees of the same scene built with different options.
+    float sah_cost(const BvhBuildOptions& options) const;
+
 public:
     shared_ptr<Hittable> left;
     shared_ptr<Hittable> right;
     Aabb box;
+
+private:
+    bool hit_node(const TraversalRay& ray, const Ray& r, float t_min, float t_max, HitRecord& rec,
+        TraversalStats& stats) const;
+    bool hit_child(bool right_child, const TraversalRay& ray, const Ray& r, float t_min, float t_max, HitRecord& rec,
+        TraversalStats& stats) const;
+    bool occluded_node(const TraversalRay& ray, const Ray& r, float t_min, float t_max) const;
+    void update_traversal_info(const Aabb& box_left, const Aabb& box_right);
+    void build(BvhBuildContext& context, const ArenaAllocator<BvhNode>& allocator, size_t begin, size_t end);
+    void make_leaf(BvhBuildContext& context, const ArenaAllocator<BvhNode>& allocator, size_t begin, size_t end);
+    void refine_treelets(TreeletContext& context, size_t& object_count);
+    void restructure_treelet(TreeletContext& context);
+    float subtree_cost(const BvhBuildOptions& options) const;
+    float treelet_cost(const TreeletContext& context) const;
+    static float treelet_child_cost(const TreeletContext& context, const shared_ptr<Hittable>& child, float parent_area);
+
+    // Whether left / right are BvhNodes, which traversal enters without a virtual call
+    bool left_is_node = false;
+    bool right_is_node = false;
+    // Axis along which the children are separated the most. Rays travelling up that axis
+    // visit the lower child first, rays travelling down it the upper one.
+    uint8_t axis = 0;
+    bool left_is_lower = true;
 };
 
+// Appends the primitives a leaf child stands for to primitives: the objects of a BvhLeafList, any
+// other object as itself. A BvhLeafList of more than max_unpacked objects is appended whole, so a
+// flattened leaf never holds more primitives than its count field can store.
+void add_leaf_primitives(const shared_ptr<Hittable>& child, size_t max_unpacked,
+    std::vector<shared_ptr<Hittable>>& primitives);
+
 #endif
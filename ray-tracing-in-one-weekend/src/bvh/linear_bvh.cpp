@@ -0,0 +1,318 @@
+#include "linear_bvh.h"
+#include "../utils/trace.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <iostream>
+
+static void set_bounds(LinearBvhNode& node, const Aabb& box)
+{
+    for (int a = 0; a < 3; a++) {
+        node.bounds_min[a] = box.min()[a];
+        node.bounds_max[a] = box.max()[a];
+    }
+}
+
+LinearBvh::LinearBvh(const BvhNode& root, float time0, float time1)
+    : time0(time0), time1(time1), depth(0)
+{
+    RT_TRACE_SCOPE("bvh_flatten");
+    flatten_node(root, 1);
+    if (depth > max_depth)
+        std::cerr << "LinearBvh: tree depth " << depth << " exceeds the in-place traversal stack (" << max_depth
+            << "), deeper paths use the heap.\n";
+}
+
+uint32_t LinearBvh::flatten_leaf(const Aabb& box, const shared_ptr<Hittable>* children, int child_count)
+{
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    LinearBvhNode node;
+    set_bounds(node, box);
+    node.primitives_offset = static_cast<uint32_t>(primitives.size());
+    // Every child adds at most max_leaf_primitives / child_count, the count cannot wrap
+    for (int i = 0; i < child_count; i++)
+        add_leaf_primitives(children[i], max_leaf_primitives / child_count, primitives);
+    node.primitive_count = static_cast<uint16_t>(primitives.size() - node.primitives_offset);
+    node.axis = 0;
+    node.second_is_lower = 0;
+    nodes[index] = node;
+    return index;
+}
+
+uint32_t LinearBvh::flatten_child(const shared_ptr<Hittable>& child, int depth)
+{
+    if (auto node = dynamic_cast<const BvhNode*>(child.get()))
+        return flatten_node(*node, depth);
+
+    Aabb box;
+    if (!child->bounding_box(time0, time1, box))
+        std::cerr << "No bounding box in LinearBvh constructor.\n";
+    return flatten_leaf(box, &child, 1);
+}
+
+uint32_t LinearBvh::flatten_node(const BvhNode& bvh_node, int depth)
+{
+    this->depth = std::max(this->depth, depth);
+
+    bool left_is_node = dynamic_cast<const BvhNode*>(bvh_node.left.get()) != nullptr;
+    bool right_is_node = dynamic_cast<const BvhNode*>(bvh_node.right.get()) != nullptr;
+
+    // A node whose children are both objects becomes a single leaf
+    if (!left_is_node && !right_is_node) {
+        shared_ptr<Hittable> children[2] = { bvh_node.left, bvh_node.right };
+        return flatten_leaf(bvh_node.box, children, bvh_node.left == bvh_node.right ? 1 : 2);
+    }
+
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    Aabb box_left, box_right;
+    bvh_node.left->bounding_box(time0, time1, box_left);
+    bvh_node.right->bounding_box(time0, time1, box_right);
+    vec3f separation = box_right.centroid() - box_left.centroid();
+    vec3f distance = separation.cwiseAbs();
+    int axis = 0;
+    if (distance.y() > distance[axis]) axis = 1;
+    if (distance.z() > distance[axis]) axis = 2;
+
+    flatten_child(bvh_node.left, depth + 1);
+    uint32_t second = flatten_child(bvh_node.right, depth + 1);
+
+    LinearBvhNode node;
+    set_bounds(node, bvh_node.box);
+    node.second_child_offset = second;
+    node.primitive_count = 0;
+    node.axis = static_cast<uint8_t>(axis);
+    node.second_is_lower = separation[axis] < 0.0f ? 1 : 0;
+    nodes[index] = node;
+    return index;
+}
+
+static inline bool hit_bounds(const LinearBvhNode& node, const TraversalRay& ray, float t_min, float t_max)
+{
+    for (int a = 0; a < 3; a++) {
+        float t0 = ((ray.sign[a] ? node.bounds_max : node.bounds_min)[a] - ray.origin[a]) * ray.inv_direction[a];
+        float t1 = ((ray.sign[a] ? node.bounds_min : node.bounds_max)[a] - ray.origin[a]) * ray.inv_direction[a];
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+    }
+    return t_min < t_max;
+}
+
+bool LinearBvh::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    if (nodes.empty())
+        return false;
+
+    TraversalStats stats;
+    stats.queries = 1;
+    bool hit_anything = hit_subtree(0, r, TraversalRay(r), t_min, t_max, rec, stats);
+    RT_STAT(thread_traversal_stats() += stats);
+    return hit_anything;
+}
+
+bool LinearBvh::hit_subtree(uint32_t root, const Ray& r, const TraversalRay& ray, float t_min, float& t_max,
+    HitRecord& rec, TraversalStats& stats) const
+{
+    TraversalStack<uint32_t, max_depth> stack;
+    uint32_t current = root;
+    bool hit_anything = false;
+
+    while (true) {
+        const LinearBvhNode& node = nodes[current];
+        stats.nodes_visited++;
+        if (hit_bounds(node, ray, t_min, t_max)) {
+            if (node.primitive_count > 0) {
+                stats.primitives_tested += node.primitive_count;
+                for (uint32_t i = 0; i < node.primitive_count; i++) {
+                    if (primitives[node.primitives_offset + i]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+            }
+            else {
+                // Visit the child nearer to the ray origin first. The other one waits on the stack and
+                // fails its box test when popped if it starts beyond the closest hit found meanwhile.
+                uint32_t first = current + 1, second = node.second_child_offset;
+                if ((ray.sign[node.axis] != 0) != (node.second_is_lower != 0))
+                    std::swap(first, second);
+                stack.push(second);
+                current = first;
+                continue;
+            }
+        }
+        if (stack.empty())
+            break;
+        current = stack.pop();
+    }
+
+    return hit_anything;
+}
+
+// Lower and upper bound of the product of x in [x0, x1] and y in [y0, y1]
+static inline float product_min(float x0, float x1, float y0, float y1)
+{
+    return std::min(std::min(x0 * y0, x0 * y1), std::min(x1 * y0, x1 * y1));
+}
+
+static inline float product_max(float x0, float x1, float y0, float y1)
+{
+    return std::max(std::max(x0 * y0, x0 * y1), std::max(x1 * y0, x1 * y1));
+}
+
+// Mask of the active rays of a coherent packet that hit the node before their own t_max. Interval
+// arithmetic over the origins and inverse directions first bounds the slab distances of all rays at
+// once and rejects a node none of them can hit; the per-ray tests compute exactly what hit_bounds does.
+static inline uint32_t packet_hit_bounds(const LinearBvhNode& node, const RayPacket& packet, float t_min,
+    const float* t_max, uint32_t active)
+{
+    const float* near_planes[3];
+    const float* far_planes[3];
+    float entry = t_min, exit = FLT_MAX;
+    for (int a = 0; a < 3; a++) {
+        near_planes[a] = packet.sign[a] ? node.bounds_max : node.bounds_min;
+        far_planes[a] = packet.sign[a] ? node.bounds_min : node.bounds_max;
+        float near_plane = near_planes[a][a], far_plane = far_planes[a][a];
+        entry = std::max(entry, product_min(near_plane - packet.origin_max[a], near_plane - packet.origin_min[a],
+            packet.inv_min[a], packet.inv_max[a]));
+        exit = std::min(exit, product_max(far_plane - packet.origin_max[a], far_plane - packet.origin_min[a],
+            packet.inv_min[a], packet.inv_max[a]));
+    }
+    if (!(entry < exit))
+        return 0;
+
+    uint32_t mask = 0;
+    for (int i = 0; i < packet.size; i++) {
+        float t0 = t_min, t1 = t_max[i];
+        for (int a = 0; a < 3; a++) {
+            float near_t = (near_planes[a][a] - packet.origin[a][i]) * packet.inv_direction[a][i];
+            float far_t = (far_planes[a][a] - packet.origin[a][i]) * packet.inv_direction[a][i];
+            t0 = near_t > t0 ? near_t : t0;
+            t1 = far_t < t1 ? far_t : t1;
+        }
+        mask |= (t0 < t1 ? 1u : 0u) << i;
+    }
+    return mask & active;
+}
+
+void LinearBvh::hit_packet(const RayPacket& packet, float t_min, float t_max, HitRecord* recs, bool* hits) const
+{
+    if (nodes.empty() || !packet.coherent || packet.size < 2) {
+        Hittable::hit_packet(packet, t_min, t_max, recs, hits);
+        return;
+    }
+
+    TraversalStats stats;
+    stats.queries = packet.size;
+
+    float closest[RayPacket::max_size];
+    for (int i = 0; i < packet.size; i++) {
+        closest[i] = t_max;
+        hits[i] = false;
+    }
+
+    // Each stack entry keeps the rays that entered the parent node, so diverging rays drop out
+    struct StackEntry {
+        uint32_t node;
+        uint32_t active;
+    };
+    TraversalStack<StackEntry, max_depth> stack;
+    uint32_t current = 0;
+    uint32_t active = (packet.size < 32 ? (1u << packet.size) : 0u) - 1u;
+
+    while (true) {
+        const LinearBvhNode& node = nodes[current];
+        stats.nodes_visited++;
+        active = packet_hit_bounds(node, packet, t_min, closest, active);
+        if (active != 0) {
+            if ((active & (active - 1)) == 0 && node.primitive_count == 0) {
+                // A single ray left, a packet test would cost as much as its own traversal
+                int i = 0;
+                while (!(active & (1u << i)))
+                    i++;
+                const Ray& r = packet.rays[i];
+                if (hit_subtree(current, r, TraversalRay(r), t_min, closest[i], recs[i], stats))
+                    hits[i] = true;
+            }
+            else if (node.primitive_count > 0) {
+                for (int i = 0; i < packet.size; i++) {
+                    if (!(active & (1u << i)))
+                        continue;
+                    stats.primitives_tested += node.primitive_count;
+                    for (uint32_t p = 0; p < node.primitive_count; p++) {
+                        if (primitives[node.primitives_offset + p]->hit(packet.rays[i], t_min, closest[i], recs[i])) {
+                            hits[i] = true;
+                            closest[i] = recs[i].t;
+                        }
+                    }
+                }
+            }
+            else {
+                // All rays share the direction signs, so they agree on the nearer child
+                uint32_t first = current + 1, second = node.second_child_offset;
+                if ((packet.sign[node.axis] != 0) != (node.second_is_lower != 0))
+                    std::swap(first, second);
+                stack.push({ second, active });
+                current = first;
+                continue;
+            }
+        }
+        if (stack.empty())
+            break;
+        StackEntry entry = stack.pop();
+        current = entry.node;
+        active = entry.active;
+    }
+
+    RT_STAT(thread_traversal_stats() += stats);
+}
+
+bool LinearBvh::occluded(const Ray& r, float t_min, float t_max) const
+{
+    if (nodes.empty())
+        return false;
+
+    const TraversalRay ray(r);
+
+    TraversalStack<uint32_t, max_depth> stack;
+    uint32_t current = 0;
+
+    while (true) {
+        const LinearBvhNode& node = nodes[current];
+        if (hit_bounds(node, ray, t_min, t_max)) {
+            if (node.primitive_count > 0) {
+                for (uint32_t i = 0; i < node.primitive_count; i++) {
+                    if (primitives[node.primitives_offset + i]->occluded(r, t_min, t_max))
+                        return true;
+                }
+            }
+            else {
+                uint32_t first = current + 1, second = node.second_child_offset;
+                if ((ray.sign[node.axis] != 0) != (node.second_is_lower != 0))
+                    std::swap(first, second);
+                stack.push(second);
+                current = first;
+                continue;
+            }
+        }
+        if (stack.empty())
+            break;
+        current = stack.pop();
+    }
+
+    return false;
+}
+
+bool LinearBvh::bounding_box(float time0, float time1, Aabb& output_box) const
+{
+    if (nodes.empty())
+        return false;
+    const LinearBvhNode& root = nodes[0];
+    output_box = Aabb(
+        vec3f(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+        vec3f(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+    return true;
+}
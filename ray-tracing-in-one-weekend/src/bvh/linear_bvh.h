@@ -0,0 +1,62 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "bvh.h"
+#include "traversal_stack.h"
+
+#include <cstdint>
+
+// 32 byte node of the flattened tree. The first child of an interior node directly
+// follows it in the array, only the offset of the second child is stored.
+struct LinearBvhNode {
+    float bounds_min[3];
+    float bounds_max[3];
+    union {
+        uint32_t primitives_offset;   // leaf
+        uint32_t second_child_offset; // interior
+    };
+    uint16_t primitive_count; // 0 for interior nodes
+    uint8_t axis;             // axis along which the children are separated the most
+    uint8_t second_is_lower;  // 1 when the second child lies below the first along axis
+};
+
+static_assert(sizeof(LinearBvhNode) == 32, "LinearBvhNode should fill half a cache line");
+
+// BvhNode tree compiled into a contiguous depth-first array, traversed with an explicit stack,
+// nearer child first. Only the primitives in the leaves are reached through virtual calls.
+class LinearBvh : public Hittable {
+public:
+    static const int max_depth = 128; // traversal stack entries kept in place, see TraversalStack
+    static const size_t max_leaf_primitives = UINT16_MAX; // LinearBvhNode::primitive_count
+
+    LinearBvh(const BvhNode& root, float time0, float time1);
+
+    virtual bool hit(
+        const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
+
+    virtual bool bounding_box(float time0, float time1, Aabb& output_box) const override;
+
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
+
+    // Traverses the tree once for the whole packet, testing each node against all rays still active
+    // in it. A subtree reached by a single ray, and every incoherent packet, continues with single rays.
+    virtual void hit_packet(const RayPacket& packet, float t_min, float t_max, HitRecord* recs, bool* hits) const override;
+
+    size_t node_count() const { return nodes.size(); }
+
+private:
+    uint32_t flatten_node(const BvhNode& node, int depth);
+    uint32_t flatten_leaf(const Aabb& box, const shared_ptr<Hittable>* children, int child_count);
+    uint32_t flatten_child(const shared_ptr<Hittable>& child, int depth);
+
+    // Closest-hit traversal of the subtree at root, t_max shrinks to the closest hit
+    bool hit_subtree(uint32_t root, const Ray& r, const TraversalRay& ray, float t_min, float& t_max,
+        HitRecord& rec, TraversalStats& stats) const;
+
+    std::vector<LinearBvhNode> nodes;
+    std::vector<shared_ptr<Hittable>> primitives;
+    float time0, time1;
+    int depth;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef TRAVERSAL_STACK_H
+#define TRAVERSAL_STACK_H
+
+#include <vector>
+
+// Nodes a traversal still has to visit. The first Capacity entries live in place; a tree deeper than
+// the flattened structures expect continues on the heap instead of losing subtrees, so Capacity only
+// decides how fast a traversal is, never what it finds.
+template <class T, int Capacity>
+class TraversalStack {
+public:
+    bool empty() const { return size == 0 && overflow.empty(); }
+
+    void push(const T& entry) {
+        if (size < Capacity)
+            entries[size++] = entry;
+        else
+            overflow.push_back(entry); // entries past Capacity are always the top of the stack
+    }
+
+    T pop() {
+        if (!overflow.empty()) {
+            T entry = overflow.back();
+            overflow.pop_back();
+            return entry;
+        }
+        return entries[--size];
+    }
+
+private:
+    T entries[Capacity];
+    int size = 0;
+    std::vector<T> overflow;
+};
+
+#endif
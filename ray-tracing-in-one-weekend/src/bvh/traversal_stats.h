@@ -0,0 +1,44 @@
+#ifndef TRAVERSAL_STATS_H
+#define TRAVERSAL_STATS_H
+
+#include "../utils/stats.h"
+
+#include <cstdint>
+
+// Work done by closest-hit queries against an acceleration structure. A node visit is one box
+// test of a BvhNode or LinearBvh node, one multi-box test of a wide BVH node, or one test of a
+// LinearBvh node against a ray packet, so the numbers compare orderings and builds of the same
+// structure rather than different structures.
+struct TraversalStats {
+    uint64_t queries = 0;
+    uint64_t nodes_visited = 0;
+    uint64_t primitives_tested = 0;
+
+    TraversalStats& operator+=(const TraversalStats& other) {
+        queries += other.queries;
+        nodes_visited += other.nodes_visited;
+        primitives_tested += other.primitives_tested;
+        return *this;
+    }
+
+    TraversalStats operator-(const TraversalStats& other) const {
+        TraversalStats difference;
+        difference.queries = queries - other.queries;
+        difference.nodes_visited = nodes_visited - other.nodes_visited;
+        difference.primitives_tested = primitives_tested - other.primitives_tested;
+        return difference;
+    }
+
+    double nodes_per_query() const { return queries > 0 ? static_cast<double>(nodes_visited) / queries : 0.0; }
+    double primitives_per_query() const { return queries > 0 ? static_cast<double>(primitives_tested) / queries : 0.0; }
+};
+
+// Counters of the calling thread. Traversals count into a local TraversalStats and add it here
+// once per query, inside RT_STAT; whoever runs the queries merges the per-thread differences.
+inline TraversalStats& thread_traversal_stats()
+{
+    thread_local TraversalStats stats;
+    return stats;
+}
+
+#endif
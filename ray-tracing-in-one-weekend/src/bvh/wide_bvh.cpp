@@ -0,0 +1,354 @@
+#include "wide_bvh.h"
+#include "../utils/simd.h"
+#include "../utils/trace.h"
+
+#include <algorithm>
+#include <iostream>
+
+// A box test kernel computes the entry distance of the ray into every child box of a node
+// and returns a bit mask of the children that were hit. The sign of the direction on an axis
+// selects which row of bounds holds the entry plane and which the exit plane.
+template <int Width>
+struct ScalarKernel {
+    static RT_FORCE_INLINE int intersect(const WideBvhNode<Width>& node, const TraversalRay& ray,
+        float t_min, float t_max, float* t_near)
+    {
+        const float* near_planes[3];
+        const float* far_planes[3];
+        for (int a = 0; a < 3; a++) {
+            near_planes[a] = node.bounds[a + 3 * ray.sign[a]];
+            far_planes[a] = node.bounds[a + 3 - 3 * ray.sign[a]];
+        }
+        int mask = 0;
+        for (int k = 0; k < Width; k++) {
+            float near = t_min, far = t_max;
+            for (int a = 0; a < 3; a++) {
+                float t0 = (near_planes[a][k] - ray.origin[a]) * ray.inv_direction[a];
+                float t1 = (far_planes[a][k] - ray.origin[a]) * ray.inv_direction[a];
+                near = t0 > near ? t0 : near;
+                far = t1 < far ? t1 : far;
+            }
+            t_near[k] = near;
+            if (near < far)
+                mask |= 1 << k;
+        }
+        return mask;
+    }
+};
+
+#ifdef RT_X86
+struct Sse4Kernel {
+    static RT_FORCE_INLINE int intersect(const WideBvhNode<4>& node, const TraversalRay& ray,
+        float t_min, float t_max, float* t_near)
+    {
+        __m128 near = _mm_set1_ps(t_min);
+        __m128 far = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_set1_ps(ray.origin[a]);
+            __m128 inv = _mm_set1_ps(ray.inv_direction[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[a + 3 * ray.sign[a]]), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[a + 3 - 3 * ray.sign[a]]), o), inv);
+            near = _mm_max_ps(t0, near);
+            far = _mm_min_ps(t1, far);
+        }
+        _mm_storeu_ps(t_near, near);
+        return _mm_movemask_ps(_mm_cmplt_ps(near, far));
+    }
+};
+
+struct Avx8Kernel {
+    RT_TARGET_AVX static inline int intersect(const WideBvhNode<8>& node, const TraversalRay& ray,
+        float t_min, float t_max, float* t_near)
+    {
+        __m256 near = _mm256_set1_ps(t_min);
+        __m256 far = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m256 o = _mm256_set1_ps(ray.origin[a]);
+            __m256 inv = _mm256_set1_ps(ray.inv_direction[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[a + 3 * ray.sign[a]]), o), inv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[a + 3 - 3 * ray.sign[a]]), o), inv);
+            near = _mm256_max_ps(t0, near);
+            far = _mm256_min_ps(t1, far);
+        }
+        _mm256_storeu_ps(t_near, near);
+        return _mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LT_OQ));
+    }
+};
+#endif
+
+template <int Width>
+WideBvh<Width>::WideBvh(const BvhNode& root, float time0, float time1, bool allow_simd)
+    : box(root.box), time0(time0), time1(time1), depth(0), use_simd(false)
+{
+    RT_TRACE_SCOPE("bvh_widen", "width", Width);
+#ifdef RT_X86
+    use_simd = allow_simd && (Width == 4 || cpu_supports_avx());
+#endif
+    build_node(root, 1);
+    if (depth > max_depth)
+        std::cerr << "WideBvh: tree depth " << depth << " exceeds the in-place traversal stack (" << max_depth
+            << "), deeper paths use the heap.\n";
+}
+
+template <int Width>
+const char* WideBvh<Width>::kernel_name() const
+{
+    if (!use_simd)
+        return "scalar";
+    return Width == 4 ? "SSE" : "AVX";
+}
+
+template <int Width>
+void WideBvh<Width>::set_leaf(WideBvhNode<Width>& node, int lane, const shared_ptr<Hittable>& child)
+{
+    size_t first = primitives.size();
+    auto bvh_node = dynamic_cast<const BvhNode*>(child.get());
+    // Both children of a leaf node together stay within max_leaf_primitives, the count cannot wrap
+    if (bvh_node != nullptr) {
+        add_leaf_primitives(bvh_node->left, max_leaf_primitives / 2, primitives);
+        if (bvh_node->right != bvh_node->left)
+            add_leaf_primitives(bvh_node->right, max_leaf_primitives / 2, primitives);
+    }
+    else {
+        add_leaf_primitives(child, max_leaf_primitives, primitives);
+    }
+    node.child[lane] = static_cast<uint32_t>(first);
+    node.count[lane] = static_cast<uint16_t>(primitives.size() - first);
+}
+
+template <int Width>
+uint32_t WideBvh<Width>::build_node(const BvhNode& bvh_node, int depth)
+{
+    this->depth = std::max(this->depth, depth);
+
+    // Start from the two children and open the largest child node until the node is full
+    shared_ptr<Hittable> children[Width];
+    Aabb boxes[Width];
+    int child_count = 0;
+    auto set_child = [&](int lane, const shared_ptr<Hittable>& child) {
+        children[lane] = child;
+        if (!child->bounding_box(time0, time1, boxes[lane]))
+            std::cerr << "No bounding box in WideBvh constructor.\n";
+    };
+    set_child(child_count++, bvh_node.left);
+    if (bvh_node.right != bvh_node.left)
+        set_child(child_count++, bvh_node.right);
+
+    while (child_count < Width) {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (int k = 0; k < child_count; k++) {
+            auto node = dynamic_cast<const BvhNode*>(children[k].get());
+            if (node == nullptr || node->left == node->right)
+                continue;
+            float area = boxes[k].surface_area();
+            if (area > largest_area) {
+                largest_area = area;
+                largest = k;
+            }
+        }
+        if (largest < 0)
+            break;
+        auto opened = static_cast<const BvhNode*>(children[largest].get());
+        shared_ptr<Hittable> opened_left = opened->left, opened_right = opened->right;
+        set_child(largest, opened_left);
+        set_child(child_count++, opened_right);
+    }
+
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    // Unused lanes keep empty bounds and are masked out by child_count
+    WideBvhNode<Width> node = {};
+    node.child_count = static_cast<uint8_t>(child_count);
+    for (int k = 0; k < child_count; k++) {
+        for (int a = 0; a < 3; a++) {
+            node.bounds[a][k] = boxes[k].min()[a];
+            node.bounds[a + 3][k] = boxes[k].max()[a];
+        }
+
+        // Nodes whose children are both objects become leaves
+        auto child_node = dynamic_cast<const BvhNode*>(children[k].get());
+        bool inner = child_node != nullptr
+            && (dynamic_cast<const BvhNode*>(child_node->left.get()) != nullptr
+                || dynamic_cast<const BvhNode*>(child_node->right.get()) != nullptr);
+        if (inner) {
+            node.child[k] = build_node(*child_node, depth + 1);
+            node.count[k] = 0;
+        }
+        else {
+            set_leaf(node, k, children[k]);
+        }
+    }
+    nodes[index] = node;
+    return index;
+}
+
+template <int Width>
+template <class Kernel>
+bool WideBvh<Width>::traverse(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    struct StackEntry {
+        uint32_t index;
+        uint32_t count; // primitives of a leaf, 0 for a node
+        float t_near;
+    };
+
+    const TraversalRay ray(r);
+    TraversalStats stats;
+    stats.queries = 1;
+
+    TraversalStack<StackEntry, stack_capacity> stack;
+    stack.push({ 0, 0, t_min });
+    bool hit_anything = false;
+
+    while (!stack.empty()) {
+        StackEntry entry = stack.pop();
+        // The closest hit so far may be nearer than this entry
+        if (entry.t_near >= t_max)
+            continue;
+
+        if (entry.count > 0) {
+            stats.primitives_tested += entry.count;
+            for (uint32_t i = 0; i < entry.count; i++) {
+                if (primitives[entry.index + i]->hit(r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+            continue;
+        }
+
+        const WideBvhNode<Width>& node = nodes[entry.index];
+        stats.nodes_visited++;
+        float t_near[Width];
+        int mask = Kernel::intersect(node, ray, t_min, t_max, t_near);
+        mask &= (1 << node.child_count) - 1;
+
+        // Push the hit children farthest first, so the nearest one is popped next
+        StackEntry found[Width];
+        int found_count = 0;
+        for (int k = 0; k < Width; k++) {
+            if ((mask >> k & 1) == 0)
+                continue;
+            StackEntry child = { node.child[k], node.count[k], t_near[k] };
+            int j = found_count++;
+            while (j > 0 && found[j - 1].t_near < child.t_near) {
+                found[j] = found[j - 1];
+                j--;
+            }
+            found[j] = child;
+        }
+        for (int k = 0; k < found_count; k++)
+            stack.push(found[k]);
+    }
+
+    RT_STAT(thread_traversal_stats() += stats);
+    return hit_anything;
+}
+
+// Any hit ends the query, so hit children are pushed in lane order without sorting them
+template <int Width>
+template <class Kernel>
+bool WideBvh<Width>::traverse_occluded(const Ray& r, float t_min, float t_max) const
+{
+    struct StackEntry {
+        uint32_t index;
+        uint32_t count; // primitives of a leaf, 0 for a node
+    };
+
+    const TraversalRay ray(r);
+
+    TraversalStack<StackEntry, stack_capacity> stack;
+    stack.push({ 0, 0 });
+
+    while (!stack.empty()) {
+        StackEntry entry = stack.pop();
+        if (entry.count > 0) {
+            for (uint32_t i = 0; i < entry.count; i++) {
+                if (primitives[entry.index + i]->occluded(r, t_min, t_max))
+                    return true;
+            }
+            continue;
+        }
+
+        const WideBvhNode<Width>& node = nodes[entry.index];
+        float t_near[Width];
+        int mask = Kernel::intersect(node, ray, t_min, t_max, t_near);
+        mask &= (1 << node.child_count) - 1;
+        for (int k = 0; k < Width; k++) {
+            if (mask >> k & 1)
+                stack.push({ node.child[k], node.count[k] });
+        }
+    }
+
+    return false;
+}
+
+template <int Width>
+bool WideBvh<Width>::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    if (nodes.empty())
+        return false;
+    if (use_simd)
+        return hit_simd(r, t_min, t_max, rec);
+    return traverse<ScalarKernel<Width>>(r, t_min, t_max, rec);
+}
+
+template <int Width>
+bool WideBvh<Width>::occluded(const Ray& r, float t_min, float t_max) const
+{
+    if (nodes.empty())
+        return false;
+    if (use_simd)
+        return occluded_simd(r, t_min, t_max);
+    return traverse_occluded<ScalarKernel<Width>>(r, t_min, t_max);
+}
+
+#ifdef RT_X86
+template <>
+bool WideBvh<4>::hit_simd(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    return traverse<Sse4Kernel>(r, t_min, t_max, rec);
+}
+
+template <>
+RT_TARGET_AVX RT_FLATTEN bool WideBvh<8>::hit_simd(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    return traverse<Avx8Kernel>(r, t_min, t_max, rec);
+}
+
+template <>
+bool WideBvh<4>::occluded_simd(const Ray& r, float t_min, float t_max) const
+{
+    return traverse_occluded<Sse4Kernel>(r, t_min, t_max);
+}
+
+template <>
+RT_TARGET_AVX RT_FLATTEN bool WideBvh<8>::occluded_simd(const Ray& r, float t_min, float t_max) const
+{
+    return traverse_occluded<Avx8Kernel>(r, t_min, t_max);
+}
+#else
+template <int Width>
+bool WideBvh<Width>::hit_simd(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    return traverse<ScalarKernel<Width>>(r, t_min, t_max, rec);
+}
+
+template <int Width>
+bool WideBvh<Width>::occluded_simd(const Ray& r, float t_min, float t_max) const
+{
+    return traverse_occluded<ScalarKernel<Width>>(r, t_min, t_max);
+}
+#endif
+
+template <int Width>
+bool WideBvh<Width>::bounding_box(float time0, float time1, Aabb& output_box) const
+{
+    output_box = box;
+    return !nodes.empty();
+}
+
+template class WideBvh<4>;
+template class WideBvh<8>;
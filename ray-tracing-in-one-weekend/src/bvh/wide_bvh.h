@@ -0,0 +1,67 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "bvh.h"
+#include "traversal_stack.h"
+
+#include <cstdint>
+
+// Node of a Width-ary BVH. The boxes of all children are stored lane by lane (structure of arrays),
+// so one SIMD instruction handles the same slab of every child.
+template <int Width>
+struct WideBvhNode {
+    float bounds[6][Width]; // min x, y, z then max x, y, z of every child
+    uint32_t child[Width];  // interior child: node index; leaf child: first primitive
+    uint16_t count[Width];  // primitives of a leaf child, 0 for an interior child
+    uint8_t child_count;    // lanes in use
+};
+
+// BVH4 / BVH8 collapsed from a binary BvhNode tree. Every node tests the ray against all of its
+// children at once (SSE for 4 children, AVX for 8, scalar code when the CPU lacks them) and visits
+// the children that were hit nearest first.
+template <int Width>
+class WideBvh : public Hittable {
+public:
+    static const int max_depth = 64; // sizes the in-place part of the traversal stack
+    static const size_t max_leaf_primitives = UINT16_MAX; // WideBvhNode::count
+
+    // allow_simd = false forces the scalar kernel, to compare against it
+    WideBvh(const BvhNode& root, float time0, float time1, bool allow_simd = true);
+
+    virtual bool hit(
+        const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
+
+    virtual bool bounding_box(float time0, float time1, Aabb& output_box) const override;
+
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Instruction set of the box test in use
+    const char* kernel_name() const;
+
+private:
+    static const int stack_capacity = max_depth * (Width - 1) + 1;
+
+    uint32_t build_node(const BvhNode& bvh_node, int depth);
+    void set_leaf(WideBvhNode<Width>& node, int lane, const shared_ptr<Hittable>& child);
+
+    template <class Kernel>
+    bool traverse(const Ray& r, float t_min, float t_max, HitRecord& rec) const;
+    bool hit_simd(const Ray& r, float t_min, float t_max, HitRecord& rec) const;
+    template <class Kernel>
+    bool traverse_occluded(const Ray& r, float t_min, float t_max) const;
+    bool occluded_simd(const Ray& r, float t_min, float t_max) const;
+
+    std::vector<WideBvhNode<Width>> nodes;
+    std::vector<shared_ptr<Hittable>> primitives;
+    Aabb box;
+    float time0, time1;
+    int depth;
+    bool use_simd;
+};
+
+typedef WideBvh<4> Bvh4;
+typedef WideBvh<8> Bvh8;
+
+#endif
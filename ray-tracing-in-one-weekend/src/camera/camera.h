@@ -54,15 +54,15 @@ public:
         this->time_close = time_close;
     }
 
-    Ray get_ray(float s, float t) const {
+    Ray get_ray(float s, float t, Sampler& sampler) const {
 
-        vec3f rd = lens_radius * random_in_unit_disk();
+        vec3f rd = lens_radius * random_in_unit_disk(sampler);
         vec3f offset = u * rd.x() + v * rd.y();
 
         return Ray(
             origin + offset,
             lower_left_corner + s * horizontal + t * vertical - origin - offset,
-            random_float(time_open, time_close)
+            random_float(sampler, time_open, time_close)
         );
     }
 
@@ -2,23 +2,49 @@
 #define SPHERE_H
 
 #include "../utils/global.h"
+#include "../utils/stats.h"
 #include "../ray/hittable.h"
 
+// Nearest t in [t_min, t_max] where the ray meets the sphere, false when there is none. Shared by the
+// hit and occluded tests of the static and the moving sphere.
+inline bool sphere_root(
+    const vec3f& center, float radius, const Ray& r, float t_min, float t_max, float& root) {
+    Eigen::Vector3f oc = r.start() - center;
+    auto a = r.direction().dot(r.direction());
+    auto half_b = oc.dot(r.direction());
+    auto c = oc.dot(oc) - radius * radius;
+    auto discriminant = half_b * half_b - a * c; // 判别式
+
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Find the nearest root that lies in the acceptable range.
+    auto nearest = (-half_b - sqrtd) / a;
+    if (nearest < t_min || t_max < nearest) {
+        nearest = (-half_b + sqrtd) / a;
+        if (nearest < t_min || t_max < nearest)
+            return false;
+    }
+    root = nearest;
+    return true;
+}
+
 class Sphere : public Hittable {
 public:
     Sphere() {}
     Sphere(Eigen::Vector3f cen, float r) : center(cen), radius(r) {};
-    Sphere(Eigen::Vector3f cen, float r, shared_ptr<Material> m)
-        : center(cen), radius(r), mat_ptr(m) {};
+    Sphere(Eigen::Vector3f cen, float r, MaterialId m)
+        : center(cen), radius(r), material_id(m) {};
 
     virtual bool hit(
         const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
     virtual bool bounding_box(float time0, float time1, Aabb& output_box) const override;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
 
 public:
     Eigen::Vector3f center;
     float radius;
-    shared_ptr<Material> mat_ptr;
+    MaterialId material_id = invalid_material;
 
 private:
     static void get_sphere_uv(const vec3f& p, float& u, float& v) {
@@ -37,34 +63,29 @@ private:
     }
 };
 
-bool Sphere::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const {
-    Eigen::Vector3f oc = r.start() - center;
-    auto a = r.direction().dot(r.direction());
-    auto half_b = oc.dot(r.direction());
-    auto c = oc.dot(oc) - radius * radius;
-    auto discriminant = half_b * half_b - a * c; // 判别式
-
-    if (discriminant < 0) return false;
-    auto sqrtd = sqrt(discriminant);
-
-    // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
-    if (root < t_min || t_max < root) {
-        root = (-half_b + sqrtd) / a;
-        if (root < t_min || t_max < root)
-            return false;
-    }
+inline bool Sphere::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const {
+    RT_STAT(thread_ray_stats().sphere_tests++);
+    float root;
+    if (!sphere_root(center, radius, r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
     Eigen::Vector3f outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.material_id = material_id;
+    RT_STAT(thread_ray_stats().sphere_hits++);
 
     return true;
 }
 
-bool Sphere::bounding_box(float time0, float time1, Aabb& output_box) const
+inline bool Sphere::occluded(const Ray& r, float t_min, float t_max) const {
+    // Any root in the range blocks the ray, no hit point or normal is needed
+    float root;
+    return sphere_root(center, radius, r, t_min, t_max, root);
+}
+
+inline bool Sphere::bounding_box(float time0, float time1, Aabb& output_box) const
 {
     output_box = Aabb(
         center - vec3f(radius, radius, radius),
@@ -0,0 +1,305 @@
+#include "sphere_soa.h"
+#include "../utils/simd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+// Ray terms shared by every sphere of a group
+struct SoaRay {
+    float ox, oy, oz;
+    float dx, dy, dz;
+    float a; // direction . direction
+};
+
+// The kernels compute each root with the operations of Sphere::hit, summing the dot products in the
+// order Eigen does, then accept the lanes in sphere order against the shrinking range like a
+// HittableList would. Where the compiler fuses multiply-adds differently than in Sphere::hit, distances
+// differ in the last bits and rays grazing a sphere from far away can turn from hit to miss.
+static bool accept_root(float root1, float root2, float t_min, float t_max, float& root)
+{
+    if (root1 >= t_min && root1 <= t_max) {
+        root = root1;
+        return true;
+    }
+    if (root2 >= t_min && root2 <= t_max) {
+        root = root2;
+        return true;
+    }
+    return false;
+}
+
+static int closest_scalar(const float* x, const float* y, const float* z, const float* radius, int count,
+    const SoaRay& ray, float t_min, float& t_max, bool any_hit)
+{
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+        float ocx = ray.ox - x[i], ocy = ray.oy - y[i], ocz = ray.oz - z[i];
+        float half_b = ocx * ray.dx + (ocy * ray.dy + ocz * ray.dz);
+        float c = (ocx * ocx + (ocy * ocy + ocz * ocz)) - radius[i] * radius[i];
+        float discriminant = half_b * half_b - ray.a * c;
+        if (discriminant < 0)
+            continue;
+        float sqrtd = std::sqrt(discriminant);
+        float root;
+        if (!accept_root((-half_b - sqrtd) / ray.a, (-half_b + sqrtd) / ray.a, t_min, t_max, root))
+            continue;
+        best = i;
+        t_max = root;
+        if (any_hit)
+            break;
+    }
+    return best;
+}
+
+// Lanes of a block that may hold a hit are rechecked in order with the range narrowed so far
+static int accept_lanes(int mask, int base, const float* roots1, const float* roots2, float t_min, float& t_max,
+    bool any_hit, int best)
+{
+    while (mask != 0) {
+        int k = 0;
+        while ((mask >> k & 1) == 0)
+            k++;
+        mask &= mask - 1;
+        float root;
+        if (accept_root(roots1[k], roots2[k], t_min, t_max, root)) {
+            best = base + k;
+            t_max = root;
+            if (any_hit)
+                break;
+        }
+    }
+    return best;
+}
+
+#ifdef RT_X86
+RT_TARGET_AVX2 static int closest_avx2(const float* x, const float* y, const float* z, const float* radius,
+    int count, int padded, const SoaRay& ray, float t_min, float& t_max, bool any_hit)
+{
+    const __m256 ox = _mm256_set1_ps(ray.ox), oy = _mm256_set1_ps(ray.oy), oz = _mm256_set1_ps(ray.oz);
+    const __m256 dx = _mm256_set1_ps(ray.dx), dy = _mm256_set1_ps(ray.dy), dz = _mm256_set1_ps(ray.dz);
+    const __m256 a = _mm256_set1_ps(ray.a);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    alignas(32) float roots1[8], roots2[8];
+
+    int best = -1;
+    for (int base = 0; base < padded; base += 8) {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(x + base));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(y + base));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(z + base));
+        __m256 r = _mm256_loadu_ps(radius + base);
+        __m256 half_b = _mm256_add_ps(_mm256_mul_ps(ocx, dx),
+            _mm256_add_ps(_mm256_mul_ps(ocy, dy), _mm256_mul_ps(ocz, dz)));
+        __m256 c = _mm256_sub_ps(
+            _mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_add_ps(_mm256_mul_ps(ocy, ocy), _mm256_mul_ps(ocz, ocz))),
+            _mm256_mul_ps(r, r));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ));
+        int lanes = count - base;
+        if (lanes < 8)
+            mask &= (1 << lanes) - 1;
+        if (mask == 0)
+            continue;
+
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 neg_half_b = _mm256_xor_ps(half_b, sign);
+        __m256 root1 = _mm256_div_ps(_mm256_sub_ps(neg_half_b, sqrtd), a);
+        __m256 root2 = _mm256_div_ps(_mm256_add_ps(neg_half_b, sqrtd), a);
+        // Neither root in the range: the lane cannot hit
+        __m256 t_min_v = _mm256_set1_ps(t_min), t_max_v = _mm256_set1_ps(t_max);
+        __m256 in_range = _mm256_or_ps(
+            _mm256_and_ps(_mm256_cmp_ps(root1, t_min_v, _CMP_GE_OQ), _mm256_cmp_ps(root1, t_max_v, _CMP_LE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(root2, t_min_v, _CMP_GE_OQ), _mm256_cmp_ps(root2, t_max_v, _CMP_LE_OQ)));
+        mask &= _mm256_movemask_ps(in_range);
+        if (mask == 0)
+            continue;
+
+        _mm256_store_ps(roots1, root1);
+        _mm256_store_ps(roots2, root2);
+        best = accept_lanes(mask, base, roots1, roots2, t_min, t_max, any_hit, best);
+        if (any_hit && best >= 0)
+            break;
+    }
+    return best;
+}
+
+RT_TARGET_AVX512 static int closest_avx512(const float* x, const float* y, const float* z, const float* radius,
+    int count, int padded, const SoaRay& ray, float t_min, float& t_max, bool any_hit)
+{
+    const __m512 ox = _mm512_set1_ps(ray.ox), oy = _mm512_set1_ps(ray.oy), oz = _mm512_set1_ps(ray.oz);
+    const __m512 dx = _mm512_set1_ps(ray.dx), dy = _mm512_set1_ps(ray.dy), dz = _mm512_set1_ps(ray.dz);
+    const __m512 a = _mm512_set1_ps(ray.a);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i sign = _mm512_set1_epi32(INT32_MIN);
+    alignas(64) float roots1[16], roots2[16];
+
+    int best = -1;
+    for (int base = 0; base < padded; base += 16) {
+        // Groups are padded to 8 lanes, the last block of 16 may only be half present
+        int lanes = std::min(count - base, 16);
+        __mmask16 load_mask = static_cast<__mmask16>(padded - base >= 16 ? 0xffff : 0xff);
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_maskz_loadu_ps(load_mask, x + base));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_maskz_loadu_ps(load_mask, y + base));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_maskz_loadu_ps(load_mask, z + base));
+        __m512 r = _mm512_maskz_loadu_ps(load_mask, radius + base);
+        __m512 half_b = _mm512_add_ps(_mm512_mul_ps(ocx, dx),
+            _mm512_add_ps(_mm512_mul_ps(ocy, dy), _mm512_mul_ps(ocz, dz)));
+        __m512 c = _mm512_sub_ps(
+            _mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_add_ps(_mm512_mul_ps(ocy, ocy), _mm512_mul_ps(ocz, ocz))),
+            _mm512_mul_ps(r, r));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(half_b, half_b), _mm512_mul_ps(a, c));
+        __mmask16 mask = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ) & static_cast<__mmask16>((1u << lanes) - 1);
+        if (mask == 0)
+            continue;
+
+        // Zero-masked: _mm512_sqrt_ps passes an undefined vector through, which GCC warns about
+        __m512 sqrtd = _mm512_maskz_sqrt_ps(mask, discriminant);
+        __m512 neg_half_b = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(half_b), sign));
+        __m512 root1 = _mm512_div_ps(_mm512_sub_ps(neg_half_b, sqrtd), a);
+        __m512 root2 = _mm512_div_ps(_mm512_add_ps(neg_half_b, sqrtd), a);
+        __m512 t_min_v = _mm512_set1_ps(t_min), t_max_v = _mm512_set1_ps(t_max);
+        __mmask16 in_range =
+            (_mm512_cmp_ps_mask(root1, t_min_v, _CMP_GE_OQ) & _mm512_cmp_ps_mask(root1, t_max_v, _CMP_LE_OQ))
+            | (_mm512_cmp_ps_mask(root2, t_min_v, _CMP_GE_OQ) & _mm512_cmp_ps_mask(root2, t_max_v, _CMP_LE_OQ));
+        mask &= in_range;
+        if (mask == 0)
+            continue;
+
+        _mm512_store_ps(roots1, root1);
+        _mm512_store_ps(roots2, root2);
+        best = accept_lanes(mask, base, roots1, roots2, t_min, t_max, any_hit, best);
+        if (any_hit && best >= 0)
+            break;
+    }
+    return best;
+}
+#endif
+
+// -1 until the first group is tested or set_simd_width is called. Render threads read it concurrently.
+static std::atomic<int> selected_width(-1);
+
+static int widest_supported()
+{
+#ifdef RT_X86
+    if (cpu_supports_avx512f())
+        return 16;
+    if (cpu_supports_avx2())
+        return 8;
+#endif
+    return 1;
+}
+
+int SphereSoA::simd_width()
+{
+    int width = selected_width.load(std::memory_order_relaxed);
+    if (width < 0) {
+        // The first caller decides, a concurrent set_simd_width is not overwritten
+        int unset = -1;
+        selected_width.compare_exchange_strong(unset, widest_supported());
+        width = selected_width.load(std::memory_order_relaxed);
+    }
+    return width;
+}
+
+void SphereSoA::set_simd_width(int width)
+{
+    int widest = widest_supported();
+    selected_width = width >= 16 && widest >= 16 ? 16 : width >= 8 && widest >= 8 ? 8 : 1;
+}
+
+SphereSoA::SphereSoA(const std::vector<const Sphere*>& spheres)
+    : count(static_cast<int>(spheres.size()))
+{
+    padded = (count + lane_padding - 1) / lane_padding * lane_padding;
+    // Padding lanes are zero and never reported: the kernels mask every lane past count
+    data.assign(4 * static_cast<size_t>(padded), 0.0f);
+    material_ids.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const Sphere& sphere = *spheres[i];
+        data[0 * padded + i] = sphere.center.x();
+        data[1 * padded + i] = sphere.center.y();
+        data[2 * padded + i] = sphere.center.z();
+        data[3 * padded + i] = sphere.radius;
+        material_ids.push_back(sphere.material_id);
+
+        Aabb sphere_box;
+        sphere.bounding_box(0, 0, sphere_box);
+        box = i == 0 ? sphere_box : box & sphere_box;
+    }
+}
+
+int SphereSoA::closest(const Ray& r, float t_min, float t_max, bool any_hit, float& t) const
+{
+    SoaRay ray;
+    ray.ox = r.start().x(); ray.oy = r.start().y(); ray.oz = r.start().z();
+    ray.dx = r.direction().x(); ray.dy = r.direction().y(); ray.dz = r.direction().z();
+    ray.a = r.direction().dot(r.direction());
+
+    int best;
+#ifdef RT_X86
+    int width = simd_width();
+    if (width == 16)
+        best = closest_avx512(lane(0), lane(1), lane(2), lane(3), count, padded, ray, t_min, t_max, any_hit);
+    else if (width == 8)
+        best = closest_avx2(lane(0), lane(1), lane(2), lane(3), count, padded, ray, t_min, t_max, any_hit);
+    else
+#endif
+        best = closest_scalar(lane(0), lane(1), lane(2), lane(3), count, ray, t_min, t_max, any_hit);
+    t = t_max;
+    return best;
+}
+
+bool SphereSoA::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+{
+    // Every sphere of the group is tested, as a HittableList of Sphere would
+    RT_STAT(thread_ray_stats().sphere_tests += count);
+    float t;
+    int i = closest(r, t_min, t_max, false, t);
+    if (i < 0)
+        return false;
+
+    vec3f center(lane(0)[i], lane(1)[i], lane(2)[i]);
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    Eigen::Vector3f outward_normal = (rec.p - center) / lane(3)[i];
+    rec.set_face_normal(r, outward_normal);
+    rec.material_id = material_ids[i];
+    RT_STAT(thread_ray_stats().sphere_hits++);
+    return true;
+}
+
+bool SphereSoA::occluded(const Ray& r, float t_min, float t_max) const
+{
+    float t;
+    return closest(r, t_min, t_max, true, t) >= 0;
+}
+
+bool SphereSoA::bounding_box(float time0, float time1, Aabb& output_box) const
+{
+    output_box = box;
+    return count > 0;
+}
+
+float SphereSoA::bytes_per_sphere() const
+{
+    size_t bytes = sizeof(SphereSoA) + data.capacity() * sizeof(float) + material_ids.capacity() * sizeof(MaterialId);
+    return count > 0 ? static_cast<float>(bytes) / count : 0.0f;
+}
+
+std::vector<shared_ptr<Hittable>> SphereSoA::pack(const std::vector<shared_ptr<Hittable>>& objects)
+{
+    std::vector<const Sphere*> spheres;
+    std::vector<shared_ptr<Hittable>> packed;
+    for (const auto& object : objects) {
+        if (auto sphere = dynamic_cast<const Sphere*>(object.get()))
+            spheres.push_back(sphere);
+        else
+            packed.push_back(object);
+    }
+    if (spheres.size() < 2)
+        return objects;
+    packed.insert(packed.begin(), make_shared<SphereSoA>(spheres));
+    return packed;
+}
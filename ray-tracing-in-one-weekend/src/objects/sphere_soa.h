@@ -0,0 +1,53 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+#include "sphere.h"
+
+#include <vector>
+
+// Group of static spheres stored as structure of arrays: all center x, then all center y, z and
+// radii, padded to a multiple of 8 lanes. A ray is tested against 8 spheres per AVX2 sequence or
+// 16 per AVX-512 sequence, and only the closest sphere fills the hit record.
+// Finds the same hits as the Sphere objects it was built from.
+class SphereSoA : public Hittable {
+public:
+    static const int lane_padding = 8;
+
+    SphereSoA(const std::vector<const Sphere*>& spheres);
+
+    virtual bool hit(
+        const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
+    virtual bool bounding_box(float time0, float time1, Aabb& output_box) const override;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
+
+    size_t size() const { return count; }
+
+    // Heap and object bytes of the group per sphere. The Sphere objects it was built from are not
+    // counted; they are only freed once nothing else, such as the scene list, holds them.
+    float bytes_per_sphere() const;
+
+    // Lanes tested per instruction sequence: 1 (scalar), 8 (AVX2) or 16 (AVX-512). The widest
+    // the CPU supports is used; set_simd_width lowers it for every group, to compare kernels.
+    static int simd_width();
+    static void set_simd_width(int width);
+
+    // Replaces the Sphere objects among objects by one SphereSoA, other objects are kept. The group
+    // copies the spheres, release the other references to them to save memory.
+    // Returns the objects unchanged when fewer than two of them are spheres.
+    static std::vector<shared_ptr<Hittable>> pack(const std::vector<shared_ptr<Hittable>>& objects);
+
+private:
+    // Index of the closest sphere with a root in [t_min, t_max] and its distance, or -1.
+    // With any_hit the first sphere found is returned instead.
+    int closest(const Ray& r, float t_min, float t_max, bool any_hit, float& t) const;
+
+    const float* lane(int row) const { return data.data() + row * padded; }
+
+    std::vector<float> data; // rows of padded floats: center x, center y, center z, radius
+    std::vector<MaterialId> material_ids;
+    int count;
+    int padded;
+    Aabb box;
+};
+
+#endif
@@ -2,14 +2,21 @@
 #define HITTABLE_H
 
 #include "ray.h"
+#include "ray_packet.h"
 #include "../bvh/aabb.h"
 
-class Material;
+#include <cstdint>
+
+// Index of a material in the MaterialTable of the scene
+typedef uint32_t MaterialId;
+
+// Material of an object that was never given one; MaterialTable rejects it
+const MaterialId invalid_material = UINT32_MAX;
 
 struct HitRecord {
     Eigen::Vector3f p;
     Eigen::Vector3f normal;
-    std::shared_ptr<Material> mat_ptr;
+    MaterialId material_id;
     float t;
     float u, v; // uv坐标
     bool front_face;
@@ -23,8 +30,24 @@ struct HitRecord {
 
 class Hittable {
 public:
+    virtual ~Hittable() {}
+
     virtual bool hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const = 0;
     virtual bool bounding_box(float time0, float time1, Aabb& output_box) const = 0;
+
+    // Whether anything is hit in [t_min, t_max], for shadow and visibility rays. Stops at the first
+    // intersection found and computes no hit record; objects override it to skip the shading work.
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const {
+        HitRecord rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Closest hits of every ray of a packet, hits[i] tells whether recs[i] was filled. Structures
+    // that share traversal work between coherent rays override it, by default rays are traced one by one.
+    virtual void hit_packet(const RayPacket& packet, float t_min, float t_max, HitRecord* recs, bool* hits) const {
+        for (int i = 0; i < packet.size; i++)
+            hits[i] = hit(packet.rays[i], t_min, t_max, recs[i]);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -16,6 +16,14 @@ bool HittableList::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) c
     return hit_anything;
 }
 
+bool HittableList::occluded(const Ray& r, float t_min, float t_max) const {
+    for (const auto& object : objects) {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
 bool HittableList::bounding_box(float time0, float time1, Aabb& output_box) const {
     if (objects.empty()) return false;
 
@@ -20,6 +20,7 @@ public:
     virtual bool hit(
         const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
     virtual bool bounding_box(float time0, float time1, Aabb& output_box) const override;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
 
 public:
     std::vector<shared_ptr<Hittable>> objects;
@@ -11,9 +11,9 @@ public:
         st(start), dir(direction), tm(time)
     {}
 
-    Eigen::Vector3f start() const { return st; }
+    const Eigen::Vector3f& start() const { return st; }
 
-    Eigen::Vector3f direction() const { return dir; }
+    const Eigen::Vector3f& direction() const { return dir; }
 
     float time() const { return tm; }
 
@@ -28,4 +28,18 @@ public:
     float tm;
 };
 
+// Ray data the box tests of an acceleration structure need, computed once per ray
+// instead of once per box: no divisions and no branches on the direction in the slab test.
+struct TraversalRay {
+    explicit TraversalRay(const Ray& r) : origin(r.start()), inv_direction(r.direction().cwiseInverse())
+    {
+        for (int a = 0; a < 3; a++)
+            sign[a] = inv_direction[a] < 0.0f ? 1 : 0;
+    }
+
+    Eigen::Vector3f origin;
+    Eigen::Vector3f inv_direction;
+    int sign[3]; // 1 where the direction is negative, the ray then enters a slab through its max plane
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "ray.h"
+
+#include <algorithm>
+
+// Up to 16 rays traced together, such as the camera rays of a block of neighbouring pixels.
+// Next to the rays it keeps their origins and inverse directions as structure of arrays for the
+// per-ray box tests, and their ranges for a single conservative box test of the whole packet.
+struct RayPacket {
+    static const int max_size = 16;
+
+    RayPacket() : size(0), coherent(false) {}
+
+    void clear() { size = 0; }
+
+    // Call finish() once all rays are added
+    void add(const Ray& r) {
+        rays[size] = r;
+        for (int a = 0; a < 3; a++) {
+            origin[a][size] = r.start()[a];
+            inv_direction[a][size] = 1.0f / r.direction()[a];
+        }
+        size++;
+    }
+
+    void finish() {
+        coherent = size > 0;
+        for (int a = 0; a < 3; a++) {
+            sign[a] = size > 0 && inv_direction[a][0] < 0.0f ? 1 : 0;
+            origin_min[a] = origin_max[a] = size > 0 ? origin[a][0] : 0.0f;
+            inv_min[a] = inv_max[a] = size > 0 ? inv_direction[a][0] : 0.0f;
+            for (int i = 0; i < size; i++) {
+                // The interval test needs the same direction signs and finite inverses for every ray
+                if ((inv_direction[a][i] < 0.0f ? 1 : 0) != sign[a] || rays[i].direction()[a] == 0.0f)
+                    coherent = false;
+                origin_min[a] = std::min(origin_min[a], origin[a][i]);
+                origin_max[a] = std::max(origin_max[a], origin[a][i]);
+                inv_min[a] = std::min(inv_min[a], inv_direction[a][i]);
+                inv_max[a] = std::max(inv_max[a], inv_direction[a][i]);
+            }
+        }
+    }
+
+    int size;
+    Ray rays[max_size];
+    float origin[3][max_size];
+    float inv_direction[3][max_size];
+
+    // Whether all rays share the direction signs below, packet traversal falls back to single rays otherwise
+    bool coherent;
+    int sign[3];
+    float origin_min[3], origin_max[3];
+    float inv_min[3], inv_max[3];
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "checkpoint.h"
+#include "../utils/file_utils.h"
+#include "../utils/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static const char checkpoint_magic[4] = { 'R', 'T', 'C', 'K' };
+static const uint32_t checkpoint_version = 1;
+
+template <class T>
+static bool write_value(FILE* file, const T& value)
+{
+    return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template <class T>
+static bool read_value(FILE* file, T& value)
+{
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+static bool write_header(FILE* file, const CheckpointHeader& header)
+{
+    return fwrite(checkpoint_magic, 1, 4, file) == 4 && write_value(file, checkpoint_version)
+        && write_value(file, header.width) && write_value(file, header.height)
+        && write_value(file, header.samples_per_pixel) && write_value(file, header.max_depth)
+        && write_value(file, header.roulette_depth) && write_value(file, header.integrator)
+        && write_value(file, header.sampler) && write_value(file, header.seed);
+}
+
+static bool read_header(FILE* file, CheckpointHeader& header)
+{
+    char magic[4];
+    uint32_t version;
+    return fread(magic, 1, 4, file) == 4 && std::equal(magic, magic + 4, checkpoint_magic)
+        && read_value(file, version) && version == checkpoint_version
+        && read_value(file, header.width) && read_value(file, header.height)
+        && read_value(file, header.samples_per_pixel) && read_value(file, header.max_depth)
+        && read_value(file, header.roulette_depth) && read_value(file, header.integrator)
+        && read_value(file, header.sampler) && read_value(file, header.seed);
+}
+
+// Byte size of the header and of one pixel in the file
+static const int64_t header_bytes = 4 + sizeof(uint32_t) + 7 * sizeof(int32_t) + sizeof(uint64_t);
+static const size_t pixel_bytes = 3 * sizeof(float) + 6 * sizeof(double) + sizeof(uint32_t);
+
+// Writes count consecutive pixels, packed into buffer first. Fields one by one, PixelEstimate has padding.
+static bool write_pixels(FILE* file, const PixelEstimate* estimates, size_t count, std::vector<char>& buffer)
+{
+    buffer.resize(count * pixel_bytes);
+    char* out = buffer.data();
+    for (size_t p = 0; p < count; p++) {
+        const PixelEstimate& estimate = estimates[p];
+        std::memcpy(out, estimate.sum.data(), 3 * sizeof(float));
+        out += 3 * sizeof(float);
+        std::memcpy(out, estimate.mean.data(), 3 * sizeof(double));
+        out += 3 * sizeof(double);
+        std::memcpy(out, estimate.m2.data(), 3 * sizeof(double));
+        out += 3 * sizeof(double);
+        std::memcpy(out, &estimate.count, sizeof(uint32_t));
+        out += sizeof(uint32_t);
+    }
+    return fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+}
+
+bool read_checkpoint(const std::string& path, const CheckpointHeader& header, std::vector<PixelEstimate>& estimates)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    CheckpointHeader stored;
+    bool ok = read_header(file, stored);
+    if (ok && !(stored == header)) {
+        std::cerr << "Checkpoint " << path << " was written with other image or sampling settings.\n";
+        ok = false;
+    }
+    // A pixel ahead of samples_per_pixel would never be rendered again, and the file has to end
+    // right after the last pixel; anything else is not a checkpoint of this render
+    std::vector<PixelEstimate> loaded(static_cast<size_t>(header.width) * header.height);
+    bool valid = ok;
+    for (size_t p = 0; valid && p < loaded.size(); p++) {
+        PixelEstimate& estimate = loaded[p];
+        valid = fread(estimate.sum.data(), sizeof(float), 3, file) == 3
+            && fread(estimate.mean.data(), sizeof(double), 3, file) == 3
+            && fread(estimate.m2.data(), sizeof(double), 3, file) == 3
+            && read_value(file, estimate.count)
+            && estimate.count <= static_cast<uint32_t>(header.samples_per_pixel);
+    }
+    valid = valid && fgetc(file) == EOF && !ferror(file);
+    if (ok && !valid)
+        std::cerr << "Checkpoint " << path << " is truncated or damaged.\n";
+    ok = valid;
+    fclose(file);
+    if (ok)
+        estimates.swap(loaded);
+    return ok;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string& path, const CheckpointHeader& header,
+    const std::vector<PixelEstimate>& estimates)
+    : path(path), working_path(path + ".partial"), header(header)
+{
+    // One row at a time, the file is never held in memory
+    working = fopen(working_path.c_str(), "w+b");
+    bool ok = working && write_header(working, header);
+    std::vector<char> buffer;
+    const size_t row_pixels = std::max<size_t>(header.width, 1);
+    for (size_t begin = 0; ok && begin < estimates.size(); begin += row_pixels)
+        ok = write_pixels(working, &estimates[begin], std::min(row_pixels, estimates.size() - begin), buffer);
+    if (!ok) {
+        std::cerr << "Cannot create checkpoint " << working_path << ", no checkpoints will be written\n";
+        if (working)
+            fclose(working);
+        working = nullptr;
+    }
+    worker = std::thread(&CheckpointWriter::worker_loop, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+    if (working) {
+        fclose(working);
+        std::remove(working_path.c_str());
+    }
+}
+
+void CheckpointWriter::commit_tile(CheckpointTile&& tile)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        committed.push_back(std::move(tile));
+    }
+    changed.notify_all();
+}
+
+void CheckpointWriter::request()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requested = true;
+    }
+    changed.notify_all();
+}
+
+void CheckpointWriter::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return committed.empty() && !requested && !busy; });
+}
+
+bool CheckpointWriter::write_tile(const CheckpointTile& tile, std::vector<char>& buffer)
+{
+    size_t height = tile.estimates.size() / tile.width;
+    for (size_t j = 0; j < height; j++) {
+        int64_t pixel = tile.x0 + (tile.y0 + static_cast<int64_t>(j)) * header.width;
+        if (!seek_file(working, header_bytes + pixel * static_cast<int64_t>(pixel_bytes))
+            || !write_pixels(working, &tile.estimates[j * tile.width], tile.width, buffer))
+            return false;
+    }
+    return true;
+}
+
+bool CheckpointWriter::write_checkpoint()
+{
+    RT_TRACE_SCOPE("checkpoint_write");
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return false;
+
+    // The working file is copied, a chunk at a time
+    std::vector<char> chunk(1 << 20);
+    bool ok = fflush(working) == 0 && seek_file(working, 0);
+    while (ok) {
+        size_t size = fread(chunk.data(), 1, chunk.size(), working);
+        ok = fwrite(chunk.data(), 1, size, file) == size;
+        if (size < chunk.size()) {
+            ok = ok && !ferror(working);
+            break;
+        }
+    }
+    ok = ok && flush_to_disk(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return replace_file(temporary, path);
+}
+
+void CheckpointWriter::worker_loop()
+{
+    std::vector<char> buffer;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [this]() { return !committed.empty() || requested || stopping; });
+        if (committed.empty() && !requested)
+            break;
+        // Tiles committed before the request are taken with it, so the checkpoint contains them
+        std::vector<CheckpointTile> tiles;
+        tiles.swap(committed);
+        bool write = requested;
+        requested = false;
+        busy = true;
+        lock.unlock();
+
+        if (working) {
+            bool ok = true;
+            for (const CheckpointTile& tile : tiles)
+                ok = ok && write_tile(tile, buffer);
+            if (write) {
+                auto write_start = std::chrono::steady_clock::now();
+                ok = ok && write_checkpoint();
+                longest_write_seconds = std::max(longest_write_seconds,
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - write_start).count());
+            }
+            // A tile written halfway leaves the working file torn, the last checkpoint is kept instead
+            if (!ok) {
+                std::cerr << "\nCannot write checkpoint " << path << ", no further checkpoints will be written\n";
+                fclose(working);
+                std::remove(working_path.c_str());
+                working = nullptr;
+            }
+        }
+
+        lock.lock();
+        busy = false;
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "pixel_estimate.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Settings a checkpoint is only valid for. The pixel sums are unnormalized, and every random number
+// of a sample follows from the seed, the pixel and the sample index, so these settings and the
+// per-pixel sample counts are all the sampler state a resumed render needs.
+struct CheckpointHeader {
+    int32_t width = 0, height = 0;
+    int32_t samples_per_pixel = 0;
+    int32_t max_depth = 0;
+    int32_t roulette_depth = 0;
+    int32_t integrator = 0;
+    int32_t sampler = 0;
+    uint64_t seed = 0;
+
+    bool operator==(const CheckpointHeader& other) const {
+        return width == other.width && height == other.height && samples_per_pixel == other.samples_per_pixel
+            && max_depth == other.max_depth && roulette_depth == other.roulette_depth
+            && integrator == other.integrator && sampler == other.sampler && seed == other.seed;
+    }
+};
+
+// Binary file: magic, version, header fields, then per pixel in row-major order the color sum
+// (3 floats), the Welford mean and m2 (3 doubles each) and the sample count, in the byte order of
+// the machine that wrote it. False when the file is missing or unreadable, was written with another
+// header, holds a sample count above samples_per_pixel or does not end after the last pixel.
+bool read_checkpoint(const std::string& path, const CheckpointHeader& header, std::vector<PixelEstimate>& estimates);
+
+// Estimates of a finished tile, row by row, the top left pixel at (x0, y0)
+struct CheckpointTile {
+    int x0 = 0, y0 = 0, width = 0;
+    std::vector<PixelEstimate> estimates;
+};
+
+// Writes checkpoints on a background thread. Render threads hand it every tile they finish, and it
+// writes the tile into path.partial, a file of the checkpoint format created up front, at the
+// tile's offsets. A checkpoint copies that file in small chunks to path.tmp, syncs it to disk and
+// renames it over path, so a crash while writing keeps the previous one. Neither a render thread
+// nor a checkpoint holds or locks the whole frame in memory. A checkpoint contains every tile
+// committed before it was requested; requests made while one is being written merge into the next.
+class CheckpointWriter {
+public:
+    // estimates: the state the render starts from, e.g. a resumed checkpoint
+    CheckpointWriter(const std::string& path, const CheckpointHeader& header,
+        const std::vector<PixelEstimate>& estimates);
+    ~CheckpointWriter(); // writes the requested checkpoint, if any, and removes path.partial
+
+    void commit_tile(CheckpointTile&& tile);
+    void request();
+    void wait(); // until every committed tile is applied and no checkpoint is pending
+    double longest_write() const { return longest_write_seconds; } // after wait
+
+private:
+    void worker_loop();
+    bool write_tile(const CheckpointTile& tile, std::vector<char>& buffer);
+    bool write_checkpoint();
+
+    std::string path;
+    std::string working_path;
+    CheckpointHeader header;
+    FILE* working = nullptr; // path.partial, only touched by the worker once it runs
+    std::vector<CheckpointTile> committed;
+    bool requested = false;
+    bool busy = false;
+    bool stopping = false;
+    double longest_write_seconds = 0.0;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef PIXEL_ESTIMATE_H
+#define PIXEL_ESTIMATE_H
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+// Running estimate of a pixel: sum of the sample colors, and the mean and variance of each channel
+// updated with Welford's algorithm, which stays accurate over thousands of samples.
+struct PixelEstimate {
+    Eigen::Vector3f sum = Eigen::Vector3f(0, 0, 0);
+    Eigen::Vector3d mean = Eigen::Vector3d(0, 0, 0);
+    Eigen::Vector3d m2 = Eigen::Vector3d(0, 0, 0); // sums of squared differences to the mean
+    uint32_t count = 0;
+
+    void add(const Eigen::Vector3f& color) {
+        sum += color;
+        count++;
+        Eigen::Vector3d x = color.cast<double>();
+        Eigen::Vector3d delta = x - mean;
+        mean += delta / count;
+        m2 += delta.cwiseProduct(x - mean);
+    }
+
+    // Largest standard error of the gamma 2 encoded channels, the values the image stores: sqrt(mean)
+    // moves by about error(mean) / (2 sqrt(mean)). FLT_MAX until two samples are known.
+    float error() const {
+        if (count < 2)
+            return FLT_MAX;
+        double largest = 0.0;
+        for (int c = 0; c < 3; c++) {
+            double standard_error = std::sqrt(m2[c] / (count - 1) / count);
+            largest = std::max(largest, standard_error / (2.0 * std::sqrt(std::max(mean[c], 1e-4))));
+        }
+        return static_cast<float>(largest);
+    }
+};
+
+#endif
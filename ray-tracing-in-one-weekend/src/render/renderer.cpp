@@ -0,0 +1,539 @@
+#include "renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cfloat>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+Renderer::Renderer(const RenderOptions& options, ThreadPool& pool)
+    : options(options), pool(pool)
+{
+    if (this->options.tile_size <= 0)
+        this->options.tile_size = 16;
+    if (this->options.cost_maps) {
+        this->options.progressive = false;
+        this->options.noise_threshold = 0.0f;
+        this->options.packet_size = 0;
+        if (this->options.integrator == Integrator::Wavefront)
+            this->options.integrator = Integrator::Iterative;
+    }
+}
+
+Eigen::Vector3f Renderer::ray_color(const Ray& r, const Hittable& world, const MaterialTable& materials, int depth,
+    Sampler& sampler, uint64_t& ray_count) const
+{
+    if (depth <= 0)
+        return Eigen::Vector3f(0, 0, 0);
+
+    ray_count++;
+    HitRecord rec;
+    bool hit = world.hit(r, ray_bias, FLT_MAX, rec);
+    RT_STAT(thread_ray_stats().add_ray(options.max_depth - depth, hit));
+    return shade(r, hit, rec, world, materials, depth, sampler, ray_count);
+}
+
+Eigen::Vector3f Renderer::shade(const Ray& r, bool hit, const HitRecord& rec, const Hittable& world,
+    const MaterialTable& materials, int depth, Sampler& sampler, uint64_t& ray_count) const
+{
+    if (hit)
+    {
+        sampler.start_bounce(options.max_depth - depth);
+        Ray scattered;
+        Eigen::Vector3f attenuation;
+        if (materials[rec.material_id].scatter(r, rec, attenuation, scattered, sampler)) {
+            RT_STAT(thread_ray_stats().scatter_events++);
+            return multi_respectively(attenuation,
+                ray_color(scattered, world, materials, depth - 1, sampler, ray_count));
+        }
+        return Eigen::Vector3f(0, 0, 0);
+    }
+    return background(r);
+}
+
+Eigen::Vector3f Renderer::trace_path(Ray r, const Hittable& world, const MaterialTable& materials, Sampler& sampler,
+    uint64_t& ray_count) const
+{
+    Eigen::Vector3f throughput(1, 1, 1);
+    for (int rays_traced = 1; rays_traced <= options.max_depth; rays_traced++) {
+        ray_count++;
+        HitRecord rec;
+        bool hit = world.hit(r, ray_bias, FLT_MAX, rec);
+        RT_STAT(thread_ray_stats().add_ray(rays_traced - 1, hit));
+        if (!hit)
+            return multi_respectively(throughput, background(r));
+
+        Ray scattered;
+        Eigen::Vector3f attenuation;
+        sampler.start_bounce(rays_traced - 1);
+        if (!materials[rec.material_id].scatter(r, rec, attenuation, scattered, sampler))
+            break;
+        RT_STAT(thread_ray_stats().scatter_events++);
+        throughput = multi_respectively(throughput, attenuation);
+        r = scattered;
+        if (!survives_roulette(rays_traced, throughput, sampler))
+            break;
+    }
+    return Eigen::Vector3f(0, 0, 0);
+}
+
+bool Renderer::survives_roulette(int rays_traced, Eigen::Vector3f& throughput, Sampler& sampler) const
+{
+    if (options.roulette_depth <= 0 || rays_traced < options.roulette_depth)
+        return true;
+    // Dim paths are ended more often; the cap also ends paths through glass, whose throughput stays 1
+    float survival = std::min(throughput.maxCoeff(), 0.95f);
+    sampler.set_dimension(Sampler::roulette_dimension(rays_traced - 1));
+    if (random_float(sampler) >= survival)
+        return false;
+    throughput /= survival;
+    return true;
+}
+
+Eigen::Vector3f Renderer::background(const Ray& r)
+{
+    Eigen::Vector3f unit_direction = r.direction().normalized();
+    float t = 0.5 * (unit_direction.y() + 1.0);
+    return (1.0 - t) * Eigen::Vector3f(1.0, 1.0, 1.0) + t * Eigen::Vector3f(0.5, 0.7, 1.0);
+}
+
+std::vector<Tile> Renderer::make_tiles(int width, int height) const
+{
+    // Image rows go bottom-up, start from the top rows like the scanline loop did
+    std::vector<Tile> tiles;
+    int size = options.tile_size;
+    for (int y1 = height; y1 > 0; y1 -= size) {
+        for (int x0 = 0; x0 < width; x0 += size) {
+            Tile tile;
+            tile.x0 = x0;
+            tile.x1 = std::min(x0 + size, width);
+            tile.y0 = std::max(y1 - size, 0);
+            tile.y1 = y1;
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+Eigen::Vector3f Renderer::render_sample(int i, int j, int s, const Hittable& world, const MaterialTable& materials,
+    const Camera& cam, int image_width, int image_height, Sampler& sampler, uint64_t& ray_count) const
+{
+    sampler.start_pixel_sample(i, j, s);
+    float u = (i + random_float(sampler)) / (image_width);
+    float v = (j + random_float(sampler)) / (image_height);
+    Ray r = cam.get_ray(u, v, sampler);
+    if (options.integrator == Integrator::Iterative)
+        return trace_path(r, world, materials, sampler, ray_count);
+    return ray_color(r, world, materials, options.max_depth, sampler, ray_count);
+}
+
+uint64_t Renderer::render_tile(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+    const Camera& cam, Image& img, uint32_t* sample_counts, PixelCosts* costs) const
+{
+    const int image_width = img.getWidth();
+    const int image_height = img.getHeight();
+    const int samples_per_pixel = options.samples_per_pixel;
+    float scale = 1.0 / samples_per_pixel;
+    if (adaptive())
+        return render_tile_adaptive(tile, world, materials, cam, img, sample_counts);
+    if (options.integrator == Integrator::Wavefront)
+        return render_tile_wavefront(tile, world, materials, cam, img);
+    if (options.packet_size > 1 && options.max_depth > 0 && options.integrator == Integrator::Recursive)
+        return render_tile_packets(tile, world, materials, cam, img);
+
+    Sampler sampler = make_sampler();
+    uint64_t ray_count = 0;
+
+    for (int j = tile.y1 - 1; j >= tile.y0; --j) {
+        for (int i = tile.x0; i < tile.x1; ++i) {
+            TraversalStats stats_before = costs ? thread_traversal_stats() : TraversalStats();
+            uint64_t rays_before = ray_count;
+            Eigen::Vector3f pixel_color(0, 0, 0);
+            for (int s = 0; s < samples_per_pixel; ++s)
+                pixel_color += render_sample(i, j, s, world, materials, cam, image_width, image_height, sampler, ray_count);
+            pixel_color = gamma_correction(scale * pixel_color, 2.0);
+            img.setPixel(i, j, pixel_color);
+            if (costs) {
+                TraversalStats pixel_stats = thread_traversal_stats() - stats_before;
+                costs->node_visits[i + j * image_width] = pixel_stats.nodes_visited;
+                costs->primitive_tests[i + j * image_width] = pixel_stats.primitives_tested;
+                costs->rays[i + j * image_width] = ray_count - rays_before;
+            }
+        }
+    }
+    return ray_count;
+}
+
+uint64_t Renderer::render_tile_adaptive(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+    const Camera& cam, Image& img, uint32_t* sample_counts) const
+{
+    const int image_width = img.getWidth();
+    const int image_height = img.getHeight();
+    const int tile_width = tile.x1 - tile.x0;
+    const int pixel_count = tile_width * (tile.y1 - tile.y0);
+    const uint32_t max_samples = static_cast<uint32_t>(
+        options.max_samples > 0 ? options.max_samples : 4 * options.samples_per_pixel);
+    const uint32_t round_samples = std::min(static_cast<uint32_t>(std::max(options.min_samples, 2)), max_samples);
+    Sampler sampler = make_sampler();
+    uint64_t ray_count = 0;
+
+    // Samples keep their index whatever the round they are taken in, so a pixel that gets n samples
+    // has the same value as with samples_per_pixel = n
+    std::vector<PixelEstimate> estimates(pixel_count);
+    auto add_samples = [&](int k, uint32_t count) {
+        int i = tile.x0 + k % tile_width, j = tile.y1 - 1 - k / tile_width;
+        PixelEstimate& estimate = estimates[k];
+        for (uint32_t n = 0; n < count; n++) {
+            int s = static_cast<int>(estimate.count);
+            estimate.add(render_sample(i, j, s, world, materials, cam, image_width, image_height, sampler, ray_count));
+        }
+    };
+
+    int64_t budget = static_cast<int64_t>(options.samples_per_pixel) * pixel_count;
+    for (int k = 0; k < pixel_count; k++) {
+        add_samples(k, round_samples);
+        budget -= round_samples;
+    }
+
+    // Further rounds give round_samples more to every pixel above the threshold, noisiest first,
+    // until none is left or the tile budget is spent
+    std::vector<int> noisy;
+    while (budget > 0) {
+        noisy.clear();
+        for (int k = 0; k < pixel_count; k++) {
+            if (estimates[k].count < max_samples && estimates[k].error() > options.noise_threshold)
+                noisy.push_back(k);
+        }
+        if (noisy.empty())
+            break;
+        std::stable_sort(noisy.begin(), noisy.end(),
+            [&](int a, int b) { return estimates[a].error() > estimates[b].error(); });
+        for (int k : noisy) {
+            uint32_t count = std::min(round_samples, max_samples - estimates[k].count);
+            count = static_cast<uint32_t>(std::min<int64_t>(count, budget));
+            if (count == 0)
+                break;
+            add_samples(k, count);
+            budget -= count;
+        }
+    }
+
+    for (int k = 0; k < pixel_count; k++) {
+        int i = tile.x0 + k % tile_width, j = tile.y1 - 1 - k / tile_width;
+        img.setPixel(i, j, gamma_correction(static_cast<float>(1.0 / estimates[k].count) * estimates[k].sum, 2.0));
+        sample_counts[i + j * image_width] = estimates[k].count;
+    }
+    return ray_count;
+}
+
+uint64_t Renderer::render_tile_packets(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+    const Camera& cam, Image& img) const
+{
+    // Blocks of 2x2, 4x2 or 4x4 pixels, the camera rays of one sample of a block form a packet
+    const int block_width = options.packet_size >= 8 ? 4 : 2;
+    const int block_height = std::min(options.packet_size, static_cast<int>(RayPacket::max_size)) / block_width;
+    const int image_width = img.getWidth();
+    const int image_height = img.getHeight();
+    const int samples_per_pixel = options.samples_per_pixel;
+    float scale = 1.0 / samples_per_pixel;
+    uint64_t ray_count = 0;
+
+    RayPacket packet;
+    HitRecord recs[RayPacket::max_size];
+    bool hits[RayPacket::max_size];
+    int pixel_x[RayPacket::max_size], pixel_y[RayPacket::max_size];
+    Eigen::Vector3f pixel_colors[RayPacket::max_size];
+    // Each path continues with the sampler state its camera ray left, as in render_tile
+    Sampler samplers[RayPacket::max_size];
+    for (Sampler& sampler : samplers)
+        sampler = make_sampler();
+
+    for (int y1 = tile.y1; y1 > tile.y0; y1 -= block_height) {
+        for (int x0 = tile.x0; x0 < tile.x1; x0 += block_width) {
+            int count = 0;
+            for (int j = y1 - 1; j >= std::max(y1 - block_height, tile.y0); --j) {
+                for (int i = x0; i < std::min(x0 + block_width, tile.x1); ++i) {
+                    pixel_x[count] = i;
+                    pixel_y[count] = j;
+                    pixel_colors[count] = Eigen::Vector3f(0, 0, 0);
+                    count++;
+                }
+            }
+
+            for (int s = 0; s < samples_per_pixel; ++s) {
+                packet.clear();
+                for (int k = 0; k < count; k++) {
+                    Sampler& sampler = samplers[k];
+                    sampler.start_pixel_sample(pixel_x[k], pixel_y[k], s);
+                    float u = (pixel_x[k] + random_float(sampler)) / (image_width);
+                    float v = (pixel_y[k] + random_float(sampler)) / (image_height);
+                    packet.add(cam.get_ray(u, v, sampler));
+                }
+                packet.finish();
+
+                ray_count += count;
+                world.hit_packet(packet, ray_bias, FLT_MAX, recs, hits);
+                for (int k = 0; k < count; k++) {
+                    RT_STAT(thread_ray_stats().add_ray(0, hits[k]));
+                    pixel_colors[k] += shade(packet.rays[k], hits[k], recs[k], world, materials, options.max_depth,
+                        samplers[k], ray_count);
+                }
+            }
+
+            for (int k = 0; k < count; k++)
+                img.setPixel(pixel_x[k], pixel_y[k], gamma_correction(scale * pixel_colors[k], 2.0));
+        }
+    }
+    return ray_count;
+}
+
+uint64_t Renderer::render_tile_samples(const Tile& tile, int sample_end, const Hittable& world,
+    const MaterialTable& materials, const Camera& cam, Image& img, CheckpointWriter* writer)
+{
+    const int image_width = img.getWidth();
+    const int image_height = img.getHeight();
+    const int tile_width = tile.x1 - tile.x0;
+    Sampler sampler = make_sampler();
+    uint64_t ray_count = 0;
+
+    // Pixels of a resumed render, or of tiles skipped by an earlier pass, may be behind the others,
+    // so each one continues from its own count. Tiles never overlap, so each works in place.
+    for (int j = tile.y1 - 1; j >= tile.y0; --j) {
+        for (int i = tile.x0; i < tile.x1; ++i) {
+            PixelEstimate& estimate = estimates[i + j * image_width];
+            for (int s = static_cast<int>(estimate.count); s < sample_end; ++s)
+                estimate.add(render_sample(i, j, s, world, materials, cam, image_width, image_height, sampler, ray_count));
+            img.setPixel(i, j, gamma_correction(static_cast<float>(1.0 / estimate.count) * estimate.sum, 2.0));
+            sample_counts[i + j * image_width] = estimate.count;
+        }
+    }
+
+    // The finished tile goes to the checkpoint writer whole, a checkpoint never sees it half done
+    if (writer) {
+        CheckpointTile finished;
+        finished.x0 = tile.x0;
+        finished.y0 = tile.y0;
+        finished.width = tile_width;
+        finished.estimates.reserve(static_cast<size_t>(tile_width) * (tile.y1 - tile.y0));
+        for (int j = tile.y0; j < tile.y1; ++j)
+            finished.estimates.insert(finished.estimates.end(),
+                estimates.begin() + tile.x0 + j * image_width, estimates.begin() + tile.x1 + j * image_width);
+        writer->commit_tile(std::move(finished));
+    }
+    return ray_count;
+}
+
+CheckpointHeader Renderer::checkpoint_header(int width, int height) const
+{
+    CheckpointHeader header;
+    header.width = width;
+    header.height = height;
+    header.samples_per_pixel = options.samples_per_pixel;
+    header.max_depth = options.max_depth;
+    header.roulette_depth = options.integrator == Integrator::Recursive ? 0 : options.roulette_depth;
+    header.integrator = static_cast<int32_t>(options.integrator);
+    header.sampler = static_cast<int32_t>(options.sampler);
+    header.seed = options.seed;
+    return header;
+}
+
+uint64_t Renderer::render_tiles(const std::vector<Tile>& tiles, const std::function<uint64_t(const Tile&)>& render_one)
+{
+    int remaining = static_cast<int>(tiles.size());
+    std::mutex progress_mutex;
+    std::atomic<uint64_t> total_rays(0);
+
+    TaskGroup group(pool);
+    for (size_t t = 0; t < tiles.size(); t++) {
+        const Tile& tile = tiles[t];
+        group.run([&, tile, t]() {
+            RT_TRACE_SCOPE("render_tile", "tile", static_cast<int64_t>(t));
+            // The counters of this thread also hold the tiles it rendered before, keep only this tile's part
+            TraversalStats before = thread_traversal_stats();
+            RayStats ray_before = thread_ray_stats();
+            WavefrontStats wavefront_before = thread_wavefront_stats();
+            total_rays += render_one(tile);
+            TraversalStats tile_stats = thread_traversal_stats() - before;
+            RayStats tile_ray_stats = thread_ray_stats() - ray_before;
+            WavefrontStats tile_wavefront_stats = thread_wavefront_stats() - wavefront_before;
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            traversal_stats += tile_stats;
+            ray_stats += tile_ray_stats;
+            wavefront_stats += tile_wavefront_stats;
+            std::cerr << "\rTiles remaining: " << --remaining << ' ' << std::flush;
+        });
+    }
+    group.wait();
+    return total_rays;
+}
+
+void Renderer::render(const Hittable& world, const MaterialTable& materials, const Camera& cam, Image& img,
+    const PassCallback& pass_done)
+{
+    std::vector<Tile> tiles = make_tiles(img.getWidth(), img.getHeight());
+    const size_t pixel_count = static_cast<size_t>(img.getWidth()) * img.getHeight();
+
+    uint64_t total_rays = 0;
+    traversal_stats = TraversalStats();
+    ray_stats = RayStats();
+    wavefront_stats = WavefrontStats();
+    sample_counts.assign(adaptive() || options.progressive ? pixel_count : 0, 0);
+    pixel_costs.assign(options.cost_maps ? pixel_count : 0);
+    tile_costs.clear();
+
+    std::cerr << "Rendering " << tiles.size() << " tiles on " << pool.size() << " threads\n";
+    auto start = std::chrono::steady_clock::now();
+
+    if (!options.progressive) {
+        total_rays = render_tiles(tiles, [&](const Tile& tile) {
+            return render_tile(tile, world, materials, cam, img, sample_counts.data(),
+                options.cost_maps ? &pixel_costs : nullptr);
+        });
+        if (options.cost_maps) {
+            for (const Tile& tile : tiles) {
+                TileCost cost;
+                cost.tile = tile;
+                for (int j = tile.y0; j < tile.y1; ++j) {
+                    for (int i = tile.x0; i < tile.x1; ++i) {
+                        cost.node_visits += pixel_costs.node_visits[i + j * img.getWidth()];
+                        cost.primitive_tests += pixel_costs.primitive_tests[i + j * img.getWidth()];
+                        cost.rays += pixel_costs.rays[i + j * img.getWidth()];
+                    }
+                }
+                tile_costs.push_back(cost);
+            }
+        }
+    }
+    else {
+        estimates.assign(pixel_count, PixelEstimate());
+        CheckpointHeader header = checkpoint_header(img.getWidth(), img.getHeight());
+        if (options.resume && !options.checkpoint_path.empty()) {
+            if (read_checkpoint(options.checkpoint_path, header, estimates)) {
+                for (int j = 0; j < img.getHeight(); ++j) {
+                    for (int i = 0; i < img.getWidth(); ++i) {
+                        const PixelEstimate& estimate = estimates[i + j * img.getWidth()];
+                        if (estimate.count > 0)
+                            img.setPixel(i, j, gamma_correction(static_cast<float>(1.0 / estimate.count) * estimate.sum, 2.0));
+                        sample_counts[i + j * img.getWidth()] = estimate.count;
+                    }
+                }
+                std::cerr << "Resumed from " << options.checkpoint_path << "\n";
+            }
+            else {
+                std::cerr << "No usable checkpoint at " << options.checkpoint_path << ", starting over\n";
+            }
+        }
+        std::unique_ptr<CheckpointWriter> writer;
+        if (!options.checkpoint_path.empty())
+            writer.reset(new CheckpointWriter(options.checkpoint_path, header, estimates));
+        auto checkpoint_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.checkpoint_interval));
+        auto last_checkpoint = start;
+        std::mutex checkpoint_mutex;
+
+        auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.time_budget));
+        bool out_of_time = false;
+
+        // Pass k takes every pixel to 2^k samples. Tiles not started before the deadline keep the
+        // samples of the previous pass, the image stays complete either way.
+        uint32_t fewest_samples = estimates.empty() ? 0 : std::min_element(estimates.begin(), estimates.end(),
+            [](const PixelEstimate& a, const PixelEstimate& b) { return a.count < b.count; })->count;
+        int sample_begin = static_cast<int>(fewest_samples);
+        while (sample_begin < options.samples_per_pixel && !out_of_time) {
+            int sample_end = 1;
+            while (sample_end <= sample_begin)
+                sample_end *= 2;
+            sample_end = std::min(sample_end, options.samples_per_pixel);
+            std::atomic<int> skipped(0);
+            RT_TRACE_SCOPE("render_pass", "samples_per_pixel", sample_end);
+            total_rays += render_tiles(tiles, [&](const Tile& tile) -> uint64_t {
+                if (options.time_budget > 0.0f && std::chrono::steady_clock::now() >= deadline) {
+                    skipped++;
+                    return 0;
+                }
+                uint64_t rays = render_tile_samples(tile, sample_end, world, materials, cam, img, writer.get());
+                if (writer) {
+                    std::unique_lock<std::mutex> lock(checkpoint_mutex, std::try_to_lock);
+                    if (lock.owns_lock() && std::chrono::steady_clock::now() - last_checkpoint >= checkpoint_period) {
+                        writer->request();
+                        last_checkpoint = std::chrono::steady_clock::now();
+                    }
+                }
+                return rays;
+            });
+            out_of_time = skipped > 0 || (options.time_budget > 0.0f && std::chrono::steady_clock::now() >= deadline);
+            if (writer) {
+                writer->request();
+                last_checkpoint = std::chrono::steady_clock::now();
+            }
+
+            double error_sum = 0.0;
+            for (const PixelEstimate& estimate : estimates)
+                error_sum += estimate.error();
+            double mean_error = error_sum / pixel_count;
+            std::cerr << "\nPass to " << sample_end << " samples per pixel done after "
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s";
+            if (sample_end > 1)
+                std::cerr << ", mean error " << mean_error;
+            if (skipped > 0)
+                std::cerr << ", " << skipped << " tiles left behind";
+            std::cerr << "\n";
+            if (pass_done)
+                pass_done(img, sample_end);
+
+            sample_begin = sample_end;
+            if (options.target_error > 0.0f && mean_error < options.target_error)
+                break;
+        }
+        if (writer) {
+            writer->wait();
+            std::cerr << "Checkpoints written to " << options.checkpoint_path << ", longest write "
+                << writer->longest_write() * 1e3 << " ms\n";
+        }
+        estimates.clear();
+    }
+
+    ray_count = total_rays;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "\nRendered in " << seconds << " s, " << total_rays << " rays, "
+        << total_rays / seconds * 1e-6 << " Mrays/s";
+    double path_count = static_cast<double>(pixel_count) * options.samples_per_pixel;
+    if (!sample_counts.empty()) {
+        path_count = 0;
+        for (uint32_t count : sample_counts)
+            path_count += count;
+        std::cerr << "\n" << (adaptive() ? "Adaptive" : "Progressive") << " sampling: "
+            << path_count / sample_counts.size() << " samples per pixel";
+    }
+    if (path_count > 0)
+        std::cerr << "\nAverage path length: " << total_rays / path_count << " rays";
+    if (options.integrator == Integrator::Wavefront) {
+        std::cerr << "\nWavefront: " << wavefront_stats.waves << " waves, generate " << wavefront_stats.generate_seconds
+            << " s, intersect " << wavefront_stats.intersect_seconds << " s, shade " << wavefront_stats.shade_seconds
+            << " s, compact " << wavefront_stats.compact_seconds << " s (thread time)";
+    }
+#ifndef RT_NO_STATS
+    print_stats(seconds);
+#endif
+}
+
+void Renderer::print_stats(double seconds) const
+{
+    // Rays per second of each depth are shares of the whole render time, they add up to the total
+    std::cerr << "\nRays by bounce depth:";
+    for (int d = 0; d < RayStats::depth_bins; d++) {
+        if (ray_stats.rays[d] == 0)
+            continue;
+        std::cerr << "\n  " << d << (d == RayStats::depth_bins - 1 ? "+" : "") << ": " << ray_stats.rays[d]
+            << " rays, " << ray_stats.rays[d] / seconds * 1e-6 << " Mrays/s, hit ratio "
+            << static_cast<double>(ray_stats.ray_hits[d]) / ray_stats.rays[d];
+    }
+    double rays = static_cast<double>(std::max<uint64_t>(ray_stats.total_rays(), 1));
+    std::cerr << "\nPer ray: " << traversal_stats.nodes_per_query() << " nodes (box tests), "
+        << traversal_stats.primitives_per_query() << " leaf tests, " << ray_stats.sphere_tests / rays << " sphere tests, " << ray_stats.scatter_events / rays << " scatter events"
+        << "\nHit ratio: " << ray_stats.total_hits() / rays << " of rays, "
+        << ray_stats.sphere_hits / std::max(static_cast<double>(ray_stats.sphere_tests), 1.0) << " of sphere tests";
+}
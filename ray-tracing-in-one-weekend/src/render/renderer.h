@@ -0,0 +1,178 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "../utils/global.h"
+#include "../utils/image.h"
+#include "../utils/thread_pool.h"
+#include "../ray/hittable.h"
+#include "../camera/camera.h"
+#include "../utils/material.h"
+#include "../bvh/traversal_stats.h"
+#include "../utils/stats.h"
+#include "../utils/trace.h"
+#include "wavefront.h"
+#include "pixel_estimate.h"
+#include "checkpoint.h"
+
+#include <functional>
+#include <string>
+
+// How the paths of a tile are traced
+enum class Integrator {
+    Recursive, // ray_color, one path after another, depth first
+    Iterative, // trace_path, one path after another, throughput carried in a loop
+    Wavefront  // all paths of a tile in stages, see wavefront.cpp
+};
+
+struct RenderOptions {
+    int samples_per_pixel = 100;
+    int max_depth = 20;
+    int thread_count = 0; // size of the thread pool, 0: one thread per hardware core
+    int tile_size = 16;   // edge length of the square tiles, in pixels
+    uint64_t seed = 0;    // with the pixel and sample index, determines every random number of a sample
+    SamplerType sampler = SamplerType::Independent;
+    int packet_size = 0;  // camera rays of 4, 8 or 16 neighbouring pixels traced as one packet, 0: single rays
+    Integrator integrator = Integrator::Recursive;
+    int wavefront_size = 1 << 14; // Wavefront: paths in flight per wave
+    int roulette_depth = 3;       // Iterative and Wavefront: rays traced before Russian roulette may end a path, 0: never
+    // Adaptive sampling (Recursive and Iterative): samples_per_pixel becomes the average budget of
+    // the pixels of a tile, pixels stop once the standard error of their stored value is below
+    // noise_threshold and the rest of the budget goes to the noisiest ones. 0: samples_per_pixel everywhere
+    float noise_threshold = 0.0f;
+    int min_samples = 16; // adaptive: samples of every pixel before its error is estimated, and per later round
+    int max_samples = 0;  // adaptive: most samples a pixel gets, 0: 4 * samples_per_pixel
+    // Progressive rendering (Recursive and Iterative): passes over the whole image take every pixel to
+    // 1, 2, 4, ... samples, up to samples_per_pixel. The image is complete after each pass.
+    bool progressive = false;
+    float time_budget = 0.0f;  // progressive: seconds after which no tile is started any more, 0: none
+    float target_error = 0.0f; // progressive: stop once the mean PixelEstimate::error() is below, 0: none
+    // Checkpoints (progressive): the pixel estimates are saved to checkpoint_path every
+    // checkpoint_interval seconds and after each pass; resume continues from the file if it matches.
+    // Finished tiles collect in checkpoint_path.partial on disk, not in memory, between checkpoints.
+    std::string checkpoint_path;
+    float checkpoint_interval = 60.0f;
+    bool resume = false;
+    // Diagnostic mode: records the BVH node visits, primitive tests and rays of every pixel, see
+    // get_pixel_costs(). Renders with the per-pixel loop of render_tile, so packets, adaptive sampling
+    // and progressive passes are off and the wavefront integrator becomes the iterative one.
+    bool cost_maps = false;
+};
+
+// Rectangle of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Work of each pixel over all its samples (index x + y * width). Node visits and primitive tests
+// come from TraversalStats, so they stay 0 when built with RT_NO_STATS.
+struct PixelCosts {
+    std::vector<uint64_t> node_visits;
+    std::vector<uint64_t> primitive_tests;
+    std::vector<uint64_t> rays;
+
+    void assign(size_t pixel_count) {
+        node_visits.assign(pixel_count, 0);
+        primitive_tests.assign(pixel_count, 0);
+        rays.assign(pixel_count, 0);
+    }
+};
+
+// Sums of PixelCosts over the pixels of a tile
+struct TileCost {
+    Tile tile;
+    uint64_t node_visits = 0;
+    uint64_t primitive_tests = 0;
+    uint64_t rays = 0;
+};
+
+// Called after each progressive pass with the image and the samples per pixel it reached
+typedef std::function<void(Image& img, int samples_per_pixel)> PassCallback;
+
+// Splits the image into tiles and renders them on a work-stealing thread pool.
+// Every tile owns a disjoint set of pixels, so results are written into the image without locks.
+class Renderer {
+public:
+    Renderer(const RenderOptions& options, ThreadPool& pool);
+
+    // Hit records of world refer to materials by their index in materials
+    void render(const Hittable& world, const MaterialTable& materials, const Camera& cam, Image& img,
+        const PassCallback& pass_done = PassCallback());
+
+    const RenderOptions& get_options() const { return options; }
+
+    // Rays traced by the last render
+    uint64_t get_ray_count() const { return ray_count; }
+
+    // Traversal work of the last render, merged from every thread
+    const TraversalStats& get_traversal_stats() const { return traversal_stats; }
+
+    // Rays, primitive tests and scatter events of the last render, merged from every thread.
+    // All zero when built with RT_NO_STATS.
+    const RayStats& get_ray_stats() const { return ray_stats; }
+
+    // Stage times of the last render with the wavefront integrator, summed over threads
+    const WavefrontStats& get_wavefront_stats() const { return wavefront_stats; }
+
+    // Samples taken per pixel by the last adaptive or progressive render (index x + y * width), empty otherwise
+    const std::vector<uint32_t>& get_sample_counts() const { return sample_counts; }
+
+    // Work per pixel and per tile of the last render with RenderOptions::cost_maps, empty otherwise
+    const PixelCosts& get_pixel_costs() const { return pixel_costs; }
+    const std::vector<TileCost>& get_tile_costs() const { return tile_costs; }
+
+private:
+    std::vector<Tile> make_tiles(int width, int height) const;
+    // Runs render_one on the thread pool for every tile and merges the statistics, returns the rays traced
+    uint64_t render_tiles(const std::vector<Tile>& tiles, const std::function<uint64_t(const Tile&)>& render_one);
+    // Takes every pixel estimate of a tile from its own sample count to sample_end, then commits the
+    // tile to writer when it is not null
+    uint64_t render_tile_samples(const Tile& tile, int sample_end, const Hittable& world,
+        const MaterialTable& materials, const Camera& cam, Image& img, CheckpointWriter* writer);
+    CheckpointHeader checkpoint_header(int width, int height) const;
+    Sampler make_sampler() const { return Sampler(options.seed, options.sampler, options.samples_per_pixel); }
+    bool adaptive() const {
+        return options.noise_threshold > 0.0f && options.integrator != Integrator::Wavefront && !options.progressive;
+    }
+    // sample_counts: one count per image pixel, filled by adaptive renders; costs: filled when not null
+    uint64_t render_tile(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+        const Camera& cam, Image& img, uint32_t* sample_counts, PixelCosts* costs) const;
+    uint64_t render_tile_adaptive(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+        const Camera& cam, Image& img, uint32_t* sample_counts) const;
+    uint64_t render_tile_packets(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+        const Camera& cam, Image& img) const;
+    uint64_t render_tile_wavefront(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+        const Camera& cam, Image& img) const;
+    // Color of sample s of pixel (i, j) with the integrator of the options
+    Eigen::Vector3f render_sample(int i, int j, int s, const Hittable& world, const MaterialTable& materials,
+        const Camera& cam, int image_width, int image_height, Sampler& sampler, uint64_t& ray_count) const;
+    Eigen::Vector3f ray_color(const Ray& r, const Hittable& world, const MaterialTable& materials, int depth,
+        Sampler& sampler, uint64_t& ray_count) const;
+    Eigen::Vector3f trace_path(Ray r, const Hittable& world, const MaterialTable& materials, Sampler& sampler,
+        uint64_t& ray_count) const;
+    // Russian roulette after the rays_traced-th ray of a path: false ends the path, otherwise
+    // throughput is divided by the survival probability so the estimate stays unbiased
+    bool survives_roulette(int rays_traced, Eigen::Vector3f& throughput, Sampler& sampler) const;
+    // Color carried by r, given the result of its closest-hit query
+    Eigen::Vector3f shade(const Ray& r, bool hit, const HitRecord& rec, const Hittable& world,
+        const MaterialTable& materials, int depth, Sampler& sampler, uint64_t& ray_count) const;
+    // Summary of ray_stats and traversal_stats, after a render that took seconds
+    void print_stats(double seconds) const;
+    // Sky color seen by a ray that hits nothing
+    static Eigen::Vector3f background(const Ray& r);
+
+    // Start of the range of hit distances, keeps scattered rays from hitting their own surface
+    static constexpr float ray_bias = 0.001f;
+
+    RenderOptions options;
+    ThreadPool& pool;
+    uint64_t ray_count = 0;
+    TraversalStats traversal_stats;
+    RayStats ray_stats;
+    WavefrontStats wavefront_stats;
+    std::vector<uint32_t> sample_counts;
+    PixelCosts pixel_costs;
+    std::vector<TileCost> tile_costs;
+    std::vector<PixelEstimate> estimates; // progressive
+};
+
+#endif
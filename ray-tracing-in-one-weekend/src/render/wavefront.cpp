@@ -0,0 +1,143 @@
+#include "renderer.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+
+// Wavefront integrator: the paths of a tile, one per pixel sample, advance together in waves of
+// at most RenderOptions::wavefront_size paths. Each bounce runs the stages over the whole wave:
+//   generate  - camera rays of the wave (once per wave)
+//   intersect - closest hit of every active path
+//   shade     - misses take the sky color, hits scatter, grouped by Material subclass so the same
+//               scatter code runs over many paths in a row
+//   compact   - ended paths leave the active list
+// Paths end with Russian roulette as in trace_path and consume the same random numbers; with
+// roulette_depth 0 they also match ray_color, up to the order the throughput is multiplied in.
+
+static double seconds_since(std::chrono::steady_clock::time_point& start)
+{
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    start = now;
+    return seconds;
+}
+
+uint64_t Renderer::render_tile_wavefront(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+    const Camera& cam, Image& img) const
+{
+    const int image_width = img.getWidth();
+    const int image_height = img.getHeight();
+    const int samples_per_pixel = options.samples_per_pixel;
+    const int tile_width = tile.x1 - tile.x0;
+    const size_t path_count = static_cast<size_t>(tile_width) * (tile.y1 - tile.y0) * samples_per_pixel;
+    const size_t wave_size = std::min(static_cast<size_t>(std::max(options.wavefront_size, 1)), path_count);
+    float scale = 1.0 / samples_per_pixel;
+    uint64_t ray_count = 0;
+
+    // Path first + p of the tile is sample (first + p) % samples_per_pixel of pixel (first + p) / samples_per_pixel,
+    // pixels in the order render_tile visits them
+    std::vector<Eigen::Vector3f> sample_colors(path_count);
+    PathBuffer paths;
+    paths.resize(wave_size, make_sampler());
+
+    // Group g of the shade stage holds paths sorted[group_offsets[g]] to sorted[group_offsets[g + 1] - 1]
+    const size_t kind_count = materials.kind_count();
+    const size_t miss_group = kind_count;
+    std::vector<uint32_t> sorted(wave_size);
+    std::vector<uint32_t> group_offsets(kind_count + 2);
+
+    WavefrontStats& stats = thread_wavefront_stats();
+    auto stage_start = std::chrono::steady_clock::now();
+
+    for (size_t first = 0; first < path_count; first += wave_size) {
+        const uint32_t count = static_cast<uint32_t>(std::min(wave_size, path_count - first));
+        stats.waves++;
+
+        // Generate
+        paths.active.clear();
+        for (uint32_t p = 0; p < count; p++) {
+            size_t pixel = (first + p) / samples_per_pixel;
+            int s = static_cast<int>((first + p) % samples_per_pixel);
+            int i = tile.x0 + static_cast<int>(pixel % tile_width);
+            int j = tile.y1 - 1 - static_cast<int>(pixel / tile_width);
+            Sampler& sampler = paths.samplers[p];
+            sampler.start_pixel_sample(i, j, s);
+            float u = (i + random_float(sampler)) / (image_width);
+            float v = (j + random_float(sampler)) / (image_height);
+            paths.set_ray(p, cam.get_ray(u, v, sampler));
+            paths.set_throughput(p, Eigen::Vector3f(1, 1, 1));
+            paths.depth[p] = options.max_depth;
+            sample_colors[first + p] = Eigen::Vector3f(0, 0, 0);
+            if (paths.depth[p] > 0)
+                paths.active.push_back(p);
+        }
+        stats.generate_seconds += seconds_since(stage_start);
+
+        while (!paths.active.empty()) {
+            // Intersect
+            for (uint32_t p : paths.active) {
+                paths.hit[p] = world.hit(paths.ray(p), ray_bias, FLT_MAX, paths.records[p]) ? 1 : 0;
+                RT_STAT(thread_ray_stats().add_ray(options.max_depth - paths.depth[p], paths.hit[p] != 0));
+            }
+            ray_count += paths.active.size();
+            stats.intersect_seconds += seconds_since(stage_start);
+
+            // Shade, counting sort of the active paths by material subclass, misses last
+            std::fill(group_offsets.begin(), group_offsets.end(), 0);
+            for (uint32_t p : paths.active)
+                group_offsets[(paths.hit[p] ? materials.kind(paths.records[p].material_id) : miss_group) + 1]++;
+            for (size_t g = 1; g < group_offsets.size(); g++)
+                group_offsets[g] += group_offsets[g - 1];
+            for (uint32_t p : paths.active)
+                sorted[group_offsets[paths.hit[p] ? materials.kind(paths.records[p].material_id) : miss_group]++] = p;
+            // The scatter moved each offset to the end of its group, which is the start of the next one
+            for (size_t g = group_offsets.size() - 1; g > 0; g--)
+                group_offsets[g] = group_offsets[g - 1];
+            group_offsets[0] = 0;
+
+            for (size_t g = 0; g < kind_count; g++) {
+                for (uint32_t k = group_offsets[g]; k < group_offsets[g + 1]; k++) {
+                    uint32_t p = sorted[k];
+                    Ray scattered;
+                    Eigen::Vector3f attenuation;
+                    paths.samplers[p].start_bounce(options.max_depth - paths.depth[p]);
+                    if (materials[paths.records[p].material_id].scatter(
+                        paths.ray(p), paths.records[p], attenuation, scattered, paths.samplers[p])) {
+                        RT_STAT(thread_ray_stats().scatter_events++);
+                        Eigen::Vector3f throughput = multi_respectively(paths.throughput(p), attenuation);
+                        paths.set_ray(p, scattered);
+                        paths.depth[p]--;
+                        if (!survives_roulette(options.max_depth - paths.depth[p], throughput, paths.samplers[p]))
+                            paths.depth[p] = 0;
+                        paths.set_throughput(p, throughput);
+                    }
+                    else {
+                        paths.depth[p] = 0;
+                    }
+                }
+            }
+            for (uint32_t k = group_offsets[miss_group]; k < group_offsets[miss_group + 1]; k++) {
+                uint32_t p = sorted[k];
+                sample_colors[first + p] = multi_respectively(paths.throughput(p), background(paths.ray(p)));
+                paths.depth[p] = 0;
+            }
+            stats.shade_seconds += seconds_since(stage_start);
+
+            // Compact
+            paths.active.erase(std::remove_if(paths.active.begin(), paths.active.end(),
+                [&](uint32_t p) { return paths.depth[p] <= 0; }), paths.active.end());
+            stats.compact_seconds += seconds_since(stage_start);
+        }
+    }
+
+    for (size_t pixel = 0; pixel * samples_per_pixel < path_count; pixel++) {
+        Eigen::Vector3f pixel_color(0, 0, 0);
+        for (int s = 0; s < samples_per_pixel; ++s)
+            pixel_color += sample_colors[pixel * samples_per_pixel + s];
+        int i = tile.x0 + static_cast<int>(pixel % tile_width);
+        int j = tile.y1 - 1 - static_cast<int>(pixel / tile_width);
+        img.setPixel(i, j, gamma_correction(scale * pixel_color, 2.0));
+    }
+    return ray_count;
+}
@@ -0,0 +1,90 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "../utils/global.h"
+#include "../ray/hittable.h"
+
+#include <cstdint>
+#include <vector>
+
+// Time spent in each stage of the wavefront integrator
+struct WavefrontStats {
+    uint64_t waves = 0;
+    double generate_seconds = 0.0;
+    double intersect_seconds = 0.0;
+    double shade_seconds = 0.0;
+    double compact_seconds = 0.0;
+
+    WavefrontStats& operator+=(const WavefrontStats& other) {
+        waves += other.waves;
+        generate_seconds += other.generate_seconds;
+        intersect_seconds += other.intersect_seconds;
+        shade_seconds += other.shade_seconds;
+        compact_seconds += other.compact_seconds;
+        return *this;
+    }
+
+    WavefrontStats operator-(const WavefrontStats& other) const {
+        WavefrontStats difference;
+        difference.waves = waves - other.waves;
+        difference.generate_seconds = generate_seconds - other.generate_seconds;
+        difference.intersect_seconds = intersect_seconds - other.intersect_seconds;
+        difference.shade_seconds = shade_seconds - other.shade_seconds;
+        difference.compact_seconds = compact_seconds - other.compact_seconds;
+        return difference;
+    }
+};
+
+// Counters of the calling thread, merged per tile like thread_traversal_stats()
+inline WavefrontStats& thread_wavefront_stats()
+{
+    thread_local WavefrontStats stats;
+    return stats;
+}
+
+// States of the paths of one wave, as structure of arrays. Every stage of the integrator sweeps
+// one or two of the arrays over all active paths instead of touching a whole path at a time.
+struct PathBuffer {
+    void resize(size_t size, const Sampler& sampler) {
+        origin_x.resize(size); origin_y.resize(size); origin_z.resize(size);
+        direction_x.resize(size); direction_y.resize(size); direction_z.resize(size);
+        time.resize(size);
+        throughput_r.resize(size); throughput_g.resize(size); throughput_b.resize(size);
+        depth.resize(size);
+        samplers.assign(size, sampler);
+        records.resize(size);
+        hit.resize(size);
+        active.reserve(size);
+    }
+
+    Ray ray(uint32_t p) const {
+        return Ray(Eigen::Vector3f(origin_x[p], origin_y[p], origin_z[p]),
+            Eigen::Vector3f(direction_x[p], direction_y[p], direction_z[p]), time[p]);
+    }
+
+    void set_ray(uint32_t p, const Ray& r) {
+        origin_x[p] = r.start().x(); origin_y[p] = r.start().y(); origin_z[p] = r.start().z();
+        direction_x[p] = r.direction().x(); direction_y[p] = r.direction().y(); direction_z[p] = r.direction().z();
+        time[p] = r.time();
+    }
+
+    Eigen::Vector3f throughput(uint32_t p) const {
+        return Eigen::Vector3f(throughput_r[p], throughput_g[p], throughput_b[p]);
+    }
+
+    void set_throughput(uint32_t p, const Eigen::Vector3f& value) {
+        throughput_r[p] = value.x(); throughput_g[p] = value.y(); throughput_b[p] = value.z();
+    }
+
+    std::vector<float> origin_x, origin_y, origin_z;
+    std::vector<float> direction_x, direction_y, direction_z;
+    std::vector<float> time;
+    std::vector<float> throughput_r, throughput_g, throughput_b;
+    std::vector<int> depth;           // rays the path may still trace, 0 once it ended
+    std::vector<Sampler> samplers;    // random sequence of the path, as left by its last stage
+    std::vector<HitRecord> records;
+    std::vector<uint8_t> hit;
+    std::vector<uint32_t> active;     // paths still traced, in increasing order
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "scenes.h"
+#include "../objects/sphere.h"
+#include "../objects/moving_sphere.h"
+#include "../utils/global.h"
+#include "../utils/trace.h"
+
+#include <cmath>
+
+HittableList random_scene(MaterialTable& materials) {
+    RT_TRACE_SCOPE("random_scene");
+    HittableList world;
+
+    auto ground_material = materials.add(make_shared<Lambertian>(vec3f(0.5, 0.5, 0.5)));
+    world.add(make_shared<Sphere>(vec3f(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_float();
+            vec3f center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
+
+            if ((center - vec3f(4, 0.2, 0)).norm() > 0.9) {
+                MaterialId sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = random_vec3f();
+                    sphere_material = materials.add(make_shared<Lambertian>(albedo));
+                    world.add(make_shared<Sphere>(center, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = random_vec3f(0.5, 1);
+                    auto fuzz = random_float(0, 0.5);
+                    sphere_material = materials.add(make_shared<Metal>(albedo, fuzz));
+                    vec3f center2 = center + vec3f(0, random_float(0, .5), 0);
+                    world.add(make_shared<MovingSphere>(
+                        center, center2, 0.0, 1.0, 0.2, sphere_material));
+                }
+                else {
+                    // glass
+                    sphere_material = materials.add(make_shared<Dielectric>(1.5));
+                    world.add(make_shared<Sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.add(make_shared<Dielectric>(1.5));
+    world.add(make_shared<Sphere>(vec3f(0, 1, 0), 1.0, material1));
+
+    auto material2 = materials.add(make_shared<Lambertian>(vec3f(0.4, 0.2, 0.1)));
+    world.add(make_shared<Sphere>(vec3f(-4, 1, 0), 1.0, material2));
+
+    auto material3 = materials.add(make_shared<Metal>(vec3f(0.7, 0.6, 0.5), 0.0));
+    world.add(make_shared<Sphere>(vec3f(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+HittableList spheres_scene(int sphere_count, MaterialTable& materials) {
+    RT_TRACE_SCOPE("spheres_scene", "spheres", sphere_count);
+    HittableList world;
+
+    auto ground_material = materials.add(make_shared<Lambertian>(vec3f(0.5, 0.5, 0.5)));
+    world.add(make_shared<Sphere>(vec3f(0, -1000, 0), 1000, ground_material));
+
+    MaterialId first_material = static_cast<MaterialId>(materials.size());
+    for (int m = 0; m < 16; m++)
+        materials.add(make_shared<Lambertian>(random_vec3f()));
+
+    float half_extent = 2.0f * cbrtf(static_cast<float>(sphere_count));
+    world.objects.reserve(sphere_count + 1);
+    for (int i = 0; i < sphere_count; i++) {
+        vec3f center(random_float(-half_extent, half_extent), random_float(0.2, 2 * half_extent),
+            random_float(-half_extent, half_extent));
+        world.add(make_shared<Sphere>(center, 0.2, first_material + random_int(0, 15)));
+    }
+
+    return world;
+}
+
@@ -0,0 +1,18 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "../ray/hittable_list.h"
+#include "../utils/material.h"
+
+// Scenes draw their random layout from default_sampler() of the calling thread, so reseeding it
+// first picks the scene.
+
+// Final scene of the book: a ground sphere, three large spheres and a grid of small diffuse,
+// moving metal and glass spheres. Adds the materials of the scene to materials, which must outlive
+// the returned objects
+HittableList random_scene(MaterialTable& materials);
+
+// Benchmark scene: a ground sphere and sphere_count small diffuse spheres, at constant density
+HittableList spheres_scene(int sphere_count, MaterialTable& materials);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Monotonic arena: objects are bump-allocated from large blocks and all the memory is
+// released at once when the arena is destroyed.
+class Arena {
+public:
+    explicit Arena(size_t block_size = 256 * 1024) : block_size(block_size), current(nullptr), remaining(0) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment) {
+        size_t padding = (alignment - reinterpret_cast<uintptr_t>(current) % alignment) % alignment;
+        if (current == nullptr || padding + size > remaining) {
+            size_t new_size = size + alignment > block_size ? size + alignment : block_size;
+            blocks.emplace_back(new char[new_size]);
+            current = blocks.back().get();
+            remaining = new_size;
+            padding = (alignment - reinterpret_cast<uintptr_t>(current) % alignment) % alignment;
+        }
+        void* p = current + padding;
+        current += padding + size;
+        remaining -= padding + size;
+        return p;
+    }
+
+private:
+    size_t block_size;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* current;
+    size_t remaining;
+};
+
+// Standard allocator drawing from a shared Arena. Containers and std::allocate_shared
+// keep a copy of the allocator, so the arena lives as long as anything allocated from it.
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(std::shared_ptr<Arena> arena) : arena(std::move(arena)) {}
+
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {}
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+    std::shared_ptr<Arena> arena;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FILE_UTILS_H
+#define FILE_UTILS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Flushes the stdio buffer of file and waits until the system has written its data to the device.
+// A file renamed over another one without this can be empty after a crash, the rename reaching the
+// disk before the data.
+inline bool flush_to_disk(FILE* file)
+{
+    if (fflush(file) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Moves to a byte offset from the start of file, past 2 GB as well
+inline bool seek_file(FILE* file, int64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+// Renames temporary over path in one step, readers see either the old or the new file
+inline bool replace_file(const std::string& temporary, const std::string& path)
+{
+#ifdef _WIN32
+    return MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+}
+
+#endif
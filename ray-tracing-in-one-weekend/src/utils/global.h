@@ -9,6 +9,8 @@
 #include <cstdlib>
 #include <Eigen/Dense>
 
+#include "random.h"
+
 // Usings
 
 using std::shared_ptr;
@@ -44,54 +46,88 @@ inline float clamp(float x, float min, float max) {
 // Random Functions
 //**************************************************************************************************
 
+// Functions taking a Sampler must be used wherever the render threads draw samples;
+// the overloads without one use the thread local default_sampler().
+
+inline float random_float(Sampler& sampler)
+{
+    return sampler.get_1d();
+}
+
+inline float random_float(Sampler& sampler, float min, float max)
+{
+    return min + (max - min) * random_float(sampler);
+}
+
+inline int random_int(Sampler& sampler, int min, int max)
+{
+    return static_cast<int>(random_float(sampler, min, max + 1));
+}
+
+inline Eigen::Vector3f random_vec3f(Sampler& sampler)
+{
+    float x = random_float(sampler);
+    float y = random_float(sampler);
+    float z = random_float(sampler);
+    return Eigen::Vector3f(x, y, z);
+}
+
+inline Eigen::Vector3f random_vec3f(Sampler& sampler, float min, float max)
+{
+    float x = random_float(sampler, min, max);
+    float y = random_float(sampler, min, max);
+    float z = random_float(sampler, min, max);
+    return Eigen::Vector3f(x, y, z);
+}
+
 inline float random_float()
 {
-    return rand() / (RAND_MAX + 1.0);
+    return random_float(default_sampler());
 }
 
 inline float random_float(float min, float max)
 {
-    return min + (max - min) * random_float();
+    return random_float(default_sampler(), min, max);
 }
 
 inline int random_int(int min, int max)
 {
-    return static_cast<int>(random_float(min, max + 1));
+    return random_int(default_sampler(), min, max);
 }
 
 inline Eigen::Vector3f random_vec3f()
 {
-    return Eigen::Vector3f(random_float(), random_float(), random_float());
+    return random_vec3f(default_sampler());
 }
 
 inline Eigen::Vector3f random_vec3f(float min, float max)
 {
-    return Eigen::Vector3f(random_float(min, max), random_float(min, max), random_float(min, max));
+    return random_vec3f(default_sampler(), min, max);
 }
 
-inline Eigen::Vector3f random_in_unit_sphere()
+inline Eigen::Vector3f random_in_unit_sphere(Sampler& sampler)
 {
     /*while (true) {
         auto p = random_vec3f(-1, 1);
         if (p.norm() >= 1) continue;
         return p;
     }*/
-    float u = random_float(), v = random_float(-1, 1), r = sqrt(1 - v * v);
+    float u = random_float(sampler), v = random_float(sampler, -1, 1), r = sqrt(1 - v * v);
     Eigen::Vector3f ref = Eigen::Vector3f{ r * cos(2 * PI * u), v, r * sin(2 * PI * u) };
     return ref;
 }
 
-inline Eigen::Vector3f random_in_hemisphere(const Eigen::Vector3f& normal)
+inline Eigen::Vector3f random_in_hemisphere(Sampler& sampler, const Eigen::Vector3f& normal)
 {
-    Eigen::Vector3f in_unit_sphere = random_in_unit_sphere();
+    Eigen::Vector3f in_unit_sphere = random_in_unit_sphere(sampler);
     if (in_unit_sphere.dot(normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
         return -in_unit_sphere;
 }
 
-inline vec3f random_in_unit_disk() {
-    float angle = random_float() * 2 * PI;
+inline vec3f random_in_unit_disk(Sampler& sampler) {
+    float angle = random_float(sampler) * 2 * PI;
     vec3f p = vec3f(cosf(angle), sinf(angle), 0);
     /*while (true) {
         auto p = vec3f(random_float(-1, 1), random_float(-1, 1), 0);
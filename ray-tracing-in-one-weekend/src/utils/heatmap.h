@@ -0,0 +1,47 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "image.h"
+
+#include <algorithm>
+#include <vector>
+
+// Image of per-pixel values (row y = 0 at the bottom, like Image), from black for 0 through blue,
+// red and yellow to white for max_value and above. max_value 0: the largest value.
+inline Image make_heatmap(const std::vector<float>& values, int width, int height, float max_value = 0.0f)
+{
+    static const Eigen::Vector3f ramp[] = {
+        Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(0, 0, 1), Eigen::Vector3f(1, 0, 0),
+        Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(1, 1, 1) };
+    const int segments = 4;
+
+    if (max_value <= 0.0f) {
+        for (float value : values)
+            max_value = std::max(max_value, value);
+    }
+
+    Image heatmap(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float t = max_value > 0.0f ? values[x + y * width] / max_value * segments : 0.0f;
+            t = std::min(t, static_cast<float>(segments));
+            int segment = std::min(static_cast<int>(t), segments - 1);
+            float f = std::min(t - segment, 1.0f);
+            heatmap.setPixel(x, y, (1.0f - f) * ramp[segment] + f * ramp[segment + 1]);
+        }
+    }
+    return heatmap;
+}
+
+// Value that the given fraction of values is at most, e.g. 0.99 to keep a few outliers from
+// darkening the rest of a heatmap
+inline float percentile(std::vector<float> values, float fraction)
+{
+    if (values.empty())
+        return 0.0f;
+    size_t k = std::min(static_cast<size_t>(fraction * values.size()), values.size() - 1);
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+}
+
+#endif
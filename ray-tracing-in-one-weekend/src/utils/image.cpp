@@ -1,7 +1,8 @@
 #include "image.h"
-#ifndef __STDC_LIB_EXT1__
+// stb uses sprintf_s when this is defined, which only the Microsoft runtime has
+#if defined(_MSC_VER) && !defined(__STDC_LIB_EXT1__)
 #define __STDC_LIB_EXT1__
-#endif // !__STDC_LIB_EXT1__
+#endif
 
 #ifndef STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -14,6 +15,7 @@
 #include "stb_image.h"
 #include "stb_image_write.h"
 #include "global.h"
+#include "file_utils.h"
 
 Image::Image(int width, int height)
 {
@@ -150,28 +152,39 @@ void Image::normalize()
     }
 }
 
-void Image::save(std::string filename)
+void Image::row_bytes(int y, unsigned char* rgb)
 {
-    unsigned char* data = new unsigned char[width * height * 3];
-    int bufSize = buf.size();
-    for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
     {
-        for (int x = 0; x < width; x++)
-        {
-            int srcIndex = parseId(x, y),
-                dstIndex = parseId(x, height - y - 1);
-            unsigned char r = static_cast<unsigned char>(clamp(buf[srcIndex].x(), 0.0, 1) * 255.999);
-            unsigned char g = static_cast<unsigned char>(clamp(buf[srcIndex].y(), 0.0, 1) * 255.999);
-            unsigned char b = static_cast<unsigned char>(clamp(buf[srcIndex].z(), 0.0, 1) * 255.999);
-            data[dstIndex * 3] = r;
-            data[dstIndex * 3 + 1] = g;
-            data[dstIndex * 3 + 2] = b;
-        }
+        const Eigen::Vector3f& color = buf[x + y * width];
+        for (int c = 0; c < 3; c++)
+            rgb[x * 3 + c] = static_cast<unsigned char>(clamp(color[c], 0.0, 1) * 255.999);
     }
+}
+
+bool Image::write(const std::string& path, const PngOptions& options)
+{
+    // png rows go top-down, buf rows bottom-up
+    return write_png(path, width, height, [this](int y, unsigned char* rgb) { row_bytes(height - y - 1, rgb); },
+        options);
+}
+
+bool Image::save(std::string filename, const PngOptions& options)
+{
     std::string fileDir = "output/" + filename + ".png";
-    stbi_write_png(fileDir.c_str(), width, height, 3, data, width * 3);
+    return write(fileDir, options);
+}
 
-    delete []data;
+bool Image::save_atomically(std::string filename, const PngOptions& options)
+{
+    std::string path = "output/" + filename + ".png";
+    std::string temporary = path + ".tmp";
+    // On the device before the rename, or a crash could leave an empty file at path
+    PngOptions synced = options;
+    synced.sync = true;
+    if (!write(temporary, synced))
+        return false;
+    return replace_file(temporary, path);
 }
 
 Image& Image::operator=(const Image& img)
@@ -1,6 +1,8 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include "png_writer.h"
+
 #include <Eigen/Dense>
 #include <vector>
 #include <string>
@@ -39,7 +41,12 @@ public:
 
     void normalize();
 
-    void save(std::string filename);
+    // Writes output/<filename>.png, see write_png for the encoding. False when writing failed.
+    bool save(std::string filename, const PngOptions& options = PngOptions());
+
+    // Like save, but writes a temporary file first and renames it over output/<filename>.png, so
+    // readers of the file never see a partly written image. False when writing failed.
+    bool save_atomically(std::string filename, const PngOptions& options = PngOptions());
 
     Image& operator= (const Image& img);
 
@@ -47,6 +54,11 @@ private:
     int width, height;
     std::vector<Eigen::Vector3f> buf;
 
+    // 8 bit RGB values of row y
+    void row_bytes(int y, unsigned char* rgb);
+
+    bool write(const std::string& path, const PngOptions& options);
+
     int parseId(int x, int y)
     {
         if (x >= 0 && x < width && y >= 0 && y < height)
@@ -3,14 +3,19 @@
 
 #include "global.h"
 #include "../ray/ray.h"
-//#include "../ray/hittable.h"
+#include "../ray/hittable.h"
 
-struct HitRecord;
+#include <algorithm>
+#include <cassert>
+#include <typeindex>
+#include <typeinfo>
+#include <vector>
 
 class Material {
 public:
     virtual bool scatter(
-        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered
+        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered,
+        Sampler& sampler
     ) const = 0;
 };
 
@@ -19,9 +24,10 @@ public:
     Lambertian(const Eigen::Vector3f& a) : albedo(a) {}
 
     virtual bool scatter(
-        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered
+        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered,
+        Sampler& sampler
     ) const override {
-        Eigen::Vector3f scatter_direction = rec.normal + random_vec3f().normalized();
+        Eigen::Vector3f scatter_direction = rec.normal + random_vec3f(sampler).normalized();
 
         if (near_zero(scatter_direction))
             scatter_direction = rec.normal;
@@ -39,10 +45,11 @@ public:
     Metal(const Eigen::Vector3f& a, float f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
     virtual bool scatter(
-        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered
+        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered,
+        Sampler& sampler
     ) const override {
         Eigen::Vector3f reflected = reflect(r_in.direction().normalized(), rec.normal);
-        scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+        scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere(sampler), r_in.time());
         attenuation = albedo;
         return true;
     }
@@ -58,7 +65,8 @@ public:
     Dielectric(float index_of_refraction) : ir(index_of_refraction) {}
 
     virtual bool scatter(
-        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered
+        const Ray& r_in, const HitRecord& rec, Eigen::Vector3f& attenuation, Ray& scattered,
+        Sampler& sampler
     ) const override {
         attenuation = Eigen::Vector3f(1.0, 1.0, 1.0);
         // 若为front_face，则光线从（一般为）空气进入该材质物体，折射率之比为空气折射率/材质折射率，即为ir的倒数
@@ -76,7 +84,7 @@ public:
         Eigen::Vector3f direction;
 
         if (cannot_refract || 
-            reflectance(cos_theta, refraction_ratio) > random_float()) // 部分反射，部分折射
+            reflectance(cos_theta, refraction_ratio) > random_float(sampler)) // 部分反射，部分折射
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -98,4 +106,38 @@ private:
     }
 };
 
+// Materials of a scene, owned by the scene for as long as it is rendered. Objects and hit records
+// refer to them by MaterialId, so a hit copies an integer instead of a reference-counted pointer.
+class MaterialTable {
+public:
+    MaterialId add(shared_ptr<Material> material) {
+        std::type_index type(typeid(*material));
+        size_t kind = std::find(kind_types.begin(), kind_types.end(), type) - kind_types.begin();
+        if (kind == kind_types.size())
+            kind_types.push_back(type);
+        materials.push_back(material);
+        kinds.push_back(static_cast<uint32_t>(kind));
+        return static_cast<MaterialId>(materials.size() - 1);
+    }
+
+    const Material& operator[](MaterialId id) const {
+        assert(id < materials.size() && "material id not added to this table");
+        return *materials[id];
+    }
+
+    size_t size() const { return materials.size(); }
+
+    // Material subclass of a material, numbered from 0 in the order the subclasses were first added
+    uint32_t kind(MaterialId id) const {
+        assert(id < kinds.size() && "material id not added to this table");
+        return kinds[id];
+    }
+    size_t kind_count() const { return kind_types.size(); }
+
+private:
+    std::vector<shared_ptr<Material>> materials;
+    std::vector<uint32_t> kinds;
+    std::vector<std::type_index> kind_types;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,448 @@
+#include "png_writer.h"
+#include "file_utils.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Checksums
+//**************************************************************************************************
+
+struct CrcTable {
+    uint32_t entries[256];
+
+    CrcTable() {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+    }
+};
+
+static uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0)
+{
+    static const CrcTable table;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static const uint32_t adler_base = 65521;
+
+static uint32_t adler32(const unsigned char* data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        // The largest run whose sums cannot overflow before the modulo
+        size_t run = std::min(size, static_cast<size_t>(5552));
+        for (size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= adler_base;
+        b %= adler_base;
+        data += run;
+        size -= run;
+    }
+    return a | (b << 16);
+}
+
+// Adler-32 of two consecutive byte runs from the checksums of each, as zlib's adler32_combine
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    uint32_t remainder = static_cast<uint32_t>(size2 % adler_base);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * sum1) % adler_base);
+    sum1 += (adler2 & 0xffff) + adler_base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + adler_base - remainder;
+    if (sum1 >= adler_base)
+        sum1 -= adler_base;
+    if (sum1 >= adler_base)
+        sum1 -= adler_base;
+    if (sum2 >= 2 * adler_base)
+        sum2 -= 2 * adler_base;
+    if (sum2 >= adler_base)
+        sum2 -= adler_base;
+    return sum1 | (sum2 << 16);
+}
+
+static void put_u32(unsigned char* out, uint32_t value)
+{
+    out[0] = static_cast<unsigned char>(value >> 24);
+    out[1] = static_cast<unsigned char>(value >> 16);
+    out[2] = static_cast<unsigned char>(value >> 8);
+    out[3] = static_cast<unsigned char>(value);
+}
+
+// Deflate
+//**************************************************************************************************
+
+// Codes of the fixed Huffman block type (RFC 1951, 3.2.6), bit-reversed for the LSB-first stream
+struct FixedCodes {
+    uint16_t literal_code[288];
+    uint8_t literal_bits[288];
+    uint8_t length_symbol[259]; // match length 3..258 -> length code - 257
+    uint8_t distance_symbol[32769];
+
+    static const uint16_t length_base[29];
+    static const uint8_t length_extra[29];
+    static const uint16_t distance_base[30];
+    static const uint8_t distance_extra[30];
+
+    static uint16_t reverse(uint32_t code, int bits) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < bits; i++)
+            reversed |= ((code >> i) & 1) << (bits - 1 - i);
+        return static_cast<uint16_t>(reversed);
+    }
+
+    FixedCodes() {
+        for (int s = 0; s < 288; s++) {
+            int bits = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+            uint32_t code = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xc0 + s - 280;
+            literal_code[s] = reverse(code, bits);
+            literal_bits[s] = static_cast<uint8_t>(bits);
+        }
+        // In code order, so 258 ends up with its own code 285 rather than 284 + 31
+        for (int c = 0; c < 29; c++) {
+            for (int l = length_base[c]; l < length_base[c] + (1 << length_extra[c]) && l <= 258; l++)
+                length_symbol[l] = static_cast<uint8_t>(c);
+        }
+        for (int c = 0; c < 30; c++) {
+            for (int d = distance_base[c]; d < distance_base[c] + (1 << distance_extra[c]) && d <= 32768; d++)
+                distance_symbol[d] = static_cast<uint8_t>(c);
+        }
+    }
+};
+
+const uint16_t FixedCodes::length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t FixedCodes::length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t FixedCodes::distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t FixedCodes::distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static const FixedCodes& fixed_codes()
+{
+    static const FixedCodes codes;
+    return codes;
+}
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<unsigned char>& out) : out(out) {}
+
+    // count <= 32
+    void put(uint32_t value, int count) {
+        bits |= static_cast<uint64_t>(value) << bit_count;
+        bit_count += count;
+        if (bit_count >= 32) {
+            unsigned char bytes[4] = { static_cast<unsigned char>(bits), static_cast<unsigned char>(bits >> 8),
+                static_cast<unsigned char>(bits >> 16), static_cast<unsigned char>(bits >> 24) };
+            out.insert(out.end(), bytes, bytes + 4);
+            bits >>= 32;
+            bit_count -= 32;
+        }
+    }
+
+    // Pads to a byte boundary and writes out the pending bytes
+    void align() {
+        if (bit_count % 8 != 0)
+            put(0, 8 - bit_count % 8);
+        for (; bit_count > 0; bit_count -= 8) {
+            out.push_back(static_cast<unsigned char>(bits));
+            bits >>= 8;
+        }
+    }
+
+private:
+    std::vector<unsigned char>& out;
+    uint64_t bits = 0;
+    int bit_count = 0;
+};
+
+// Hash chain steps and the match length that ends the search early, by compression level
+static const int chain_limits[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+static const int nice_lengths[10] = { 0, 8, 16, 32, 64, 128, 128, 258, 258, 258 };
+
+// Appends data as non-final deflate blocks that end on a byte boundary (a sync flush), so the output
+// of consecutive calls can be concatenated. Level 0 stores the bytes, higher levels search longer.
+static void deflate_flushed(const unsigned char* data, size_t size, int level, std::vector<unsigned char>& out)
+{
+    BitWriter writer(out);
+    if (level <= 0) {
+        for (size_t offset = 0; offset < size; offset += 65535) {
+            uint32_t length = static_cast<uint32_t>(std::min(size - offset, static_cast<size_t>(65535)));
+            writer.put(0, 3); // BFINAL 0, BTYPE 00: stored
+            writer.align();
+            writer.put(length, 16);
+            writer.put(~length & 0xffff, 16);
+            out.insert(out.end(), data + offset, data + offset + length);
+        }
+        return;
+    }
+
+    const FixedCodes& codes = fixed_codes();
+    auto literal = [&](int symbol) { writer.put(codes.literal_code[symbol], codes.literal_bits[symbol]); };
+    writer.put(0, 1); // BFINAL 0
+    writer.put(1, 2); // BTYPE 01: fixed Huffman codes
+
+    const int hash_bits = 15;
+    const size_t window = 32768;
+    const int max_chain = chain_limits[level];
+    const size_t nice_length = static_cast<size_t>(nice_lengths[level]);
+    std::vector<int32_t> head(static_cast<size_t>(1) << hash_bits, -1);
+    std::vector<int32_t> previous(size);
+    auto hash = [&](size_t i) {
+        uint32_t key = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+        return (key * 2654435761u) >> (32 - hash_bits);
+    };
+    auto insert = [&](size_t i) {
+        uint32_t h = hash(i);
+        previous[i] = head[h];
+        head[h] = static_cast<int32_t>(i);
+    };
+
+    size_t i = 0;
+    while (i < size) {
+        size_t best_length = 0, best_distance = 0;
+        if (i + 3 <= size) {
+            size_t max_length = std::min(size - i, static_cast<size_t>(258));
+            int32_t candidate = head[hash(i)];
+            for (int chain = max_chain; candidate >= 0 && i - static_cast<size_t>(candidate) <= window && chain > 0;
+                chain--) {
+                const unsigned char* a = data + candidate;
+                const unsigned char* b = data + i;
+                if (a[best_length] == b[best_length]) {
+                    size_t length = 0;
+                    while (length < max_length && a[length] == b[length])
+                        length++;
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (length >= nice_length || length == max_length)
+                            break;
+                    }
+                }
+                candidate = previous[candidate];
+            }
+            insert(i);
+        }
+        if (best_length >= 3) {
+            int length_code = codes.length_symbol[best_length];
+            literal(257 + length_code);
+            writer.put(static_cast<uint32_t>(best_length - FixedCodes::length_base[length_code]),
+                FixedCodes::length_extra[length_code]);
+            int distance_code = codes.distance_symbol[best_distance];
+            writer.put(FixedCodes::reverse(distance_code, 5), 5);
+            writer.put(static_cast<uint32_t>(best_distance - FixedCodes::distance_base[distance_code]),
+                FixedCodes::distance_extra[distance_code]);
+            for (size_t k = i + 1; k < i + best_length && k + 3 <= size; k++)
+                insert(k);
+            i += best_length;
+        }
+        else {
+            literal(data[i]);
+            i++;
+        }
+    }
+    literal(256); // end of block
+    // Sync flush: an empty non-final stored block
+    writer.put(0, 3);
+    writer.align();
+    writer.put(0, 16);
+    writer.put(0xffff, 16);
+}
+
+// Png
+//**************************************************************************************************
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+static void apply_filter(int type, const unsigned char* row, const unsigned char* above, size_t stride,
+    unsigned char* out)
+{
+    const size_t bpp = 3; // the left neighbour of the first pixel is 0
+    switch (type) {
+    case 0:
+        std::copy(row, row + stride, out);
+        break;
+    case 1:
+        std::copy(row, row + bpp, out);
+        for (size_t i = bpp; i < stride; i++)
+            out[i] = static_cast<unsigned char>(row[i] - row[i - bpp]);
+        break;
+    case 2:
+        for (size_t i = 0; i < stride; i++)
+            out[i] = static_cast<unsigned char>(row[i] - above[i]);
+        break;
+    case 3:
+        for (size_t i = 0; i < bpp; i++)
+            out[i] = static_cast<unsigned char>(row[i] - (above[i] >> 1));
+        for (size_t i = bpp; i < stride; i++)
+            out[i] = static_cast<unsigned char>(row[i] - ((row[i - bpp] + above[i]) >> 1));
+        break;
+    default:
+        for (size_t i = 0; i < bpp; i++)
+            out[i] = static_cast<unsigned char>(row[i] - above[i]);
+        for (size_t i = bpp; i < stride; i++)
+            out[i] = static_cast<unsigned char>(row[i] - paeth(row[i - bpp], above[i], above[i - bpp]));
+        break;
+    }
+}
+
+// Filter type byte and filtered row. With adaptive set, picks the filter with the smallest sum of
+// absolute (signed) values, the heuristic of the png specification and stbi_write_png; scratch
+// holds 5 * stride bytes.
+static void filter_row(const unsigned char* row, const unsigned char* above, size_t stride, bool adaptive,
+    unsigned char* scratch, unsigned char* out)
+{
+    int best_type = 0;
+    if (adaptive) {
+        uint64_t best_sum = UINT64_MAX;
+        for (int type = 0; type < 5; type++) {
+            unsigned char* candidate = scratch + type * stride;
+            apply_filter(type, row, above, stride, candidate);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < stride; i++)
+                sum += std::abs(static_cast<int>(static_cast<signed char>(candidate[i])));
+            if (sum < best_sum) {
+                best_sum = sum;
+                best_type = type;
+            }
+        }
+        std::copy(scratch + best_type * stride, scratch + (best_type + 1) * stride, out + 1);
+    }
+    else {
+        apply_filter(0, row, above, stride, out + 1);
+    }
+    out[0] = static_cast<unsigned char>(best_type);
+}
+
+struct PngBand {
+    std::vector<unsigned char> chunk; // the complete IDAT chunk
+    uint32_t adler = 1;               // of the filtered rows
+    size_t filtered_size = 0;
+};
+
+static void encode_band(int width, int y0, int y1, const PngRowSource& row, int level, PngBand& band)
+{
+    RT_TRACE_SCOPE("png_band", "first_row", y0);
+    const size_t stride = static_cast<size_t>(width) * 3;
+    // The filters of the first row look at the last row of the band above
+    std::vector<unsigned char> above(stride, 0), current(stride);
+    if (y0 > 0)
+        row(y0 - 1, above.data());
+    std::vector<unsigned char> filtered((y1 - y0) * (stride + 1)), scratch(5 * stride);
+    for (int y = y0; y < y1; y++) {
+        row(y, current.data());
+        filter_row(current.data(), above.data(), stride, level > 0, scratch.data(),
+            &filtered[(y - y0) * (stride + 1)]);
+        above.swap(current);
+    }
+    band.adler = adler32(filtered.data(), filtered.size());
+    band.filtered_size = filtered.size();
+
+    std::vector<unsigned char>& chunk = band.chunk;
+    chunk.reserve(filtered.size() / 2 + 64);
+    chunk.assign({ 0, 0, 0, 0, 'I', 'D', 'A', 'T' });
+    if (y0 == 0) {
+        // zlib header: deflate with a 32 KB window, no dictionary
+        chunk.push_back(0x78);
+        chunk.push_back(0x01);
+    }
+    deflate_flushed(filtered.data(), filtered.size(), level, chunk);
+    put_u32(chunk.data(), static_cast<uint32_t>(chunk.size() - 8));
+    unsigned char crc[4];
+    put_u32(crc, crc32(chunk.data() + 4, chunk.size() - 4));
+    chunk.insert(chunk.end(), crc, crc + 4);
+}
+
+static bool write_chunk(FILE* file, const char* type, const unsigned char* data, uint32_t size)
+{
+    unsigned char header[8], crc[4];
+    put_u32(header, size);
+    std::copy(type, type + 4, header + 4);
+    put_u32(crc, crc32(data, size, crc32(header + 4, 4)));
+    return fwrite(header, 1, 8, file) == 8 && (size == 0 || fwrite(data, 1, size, file) == size)
+        && fwrite(crc, 1, 4, file) == 4;
+}
+
+bool write_png(const std::string& path, int width, int height, const PngRowSource& row, const PngOptions& options)
+{
+    RT_TRACE_SCOPE("png_write", "rows", height);
+    if (width <= 0 || height <= 0)
+        return false;
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    const size_t stride = static_cast<size_t>(width) * 3;
+    const int level = std::min(std::max(options.compression_level, 0), 9);
+    const int band_rows = options.band_rows > 0 ? options.band_rows
+        : std::max(1, static_cast<int>((256 * 1024) / stride));
+    const int band_count = (height + band_rows - 1) / band_rows;
+    const int group_size = options.pool != nullptr ? 2 * options.pool->size() : 1;
+
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char header[13];
+    put_u32(header, static_cast<uint32_t>(width));
+    put_u32(header + 4, static_cast<uint32_t>(height));
+    header[8] = 8;  // bits per channel
+    header[9] = 2;  // RGB
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filters
+    header[12] = 0; // not interlaced
+    bool ok = fwrite(signature, 1, 8, file) == 8 && write_chunk(file, "IHDR", header, 13);
+
+    uint32_t adler = 1;
+    for (int group_begin = 0; ok && group_begin < band_count; group_begin += group_size) {
+        int group_end = std::min(band_count, group_begin + group_size);
+        std::vector<PngBand> bands(group_end - group_begin);
+        auto encode = [&](int b) {
+            int y0 = b * band_rows;
+            encode_band(width, y0, std::min(height, y0 + band_rows), row, level, bands[b - group_begin]);
+        };
+        if (options.pool != nullptr && bands.size() > 1) {
+            TaskGroup tasks(*options.pool);
+            for (int b = group_begin; b < group_end; b++)
+                tasks.run([&encode, b]() { encode(b); });
+            tasks.wait();
+        }
+        else {
+            for (int b = group_begin; b < group_end; b++)
+                encode(b);
+        }
+
+        RT_TRACE_SCOPE("file_write", "bands", group_end - group_begin);
+        for (const PngBand& band : bands) {
+            ok = ok && fwrite(band.chunk.data(), 1, band.chunk.size(), file) == band.chunk.size();
+            adler = adler32_combine(adler, band.adler, band.filtered_size);
+        }
+    }
+
+    // End of the zlib stream: an empty final block with fixed codes, then the Adler-32 of all bands
+    unsigned char stream_end[6] = { 0x03, 0x00 };
+    put_u32(stream_end + 2, adler);
+    ok = ok && write_chunk(file, "IDAT", stream_end, 6) && write_chunk(file, "IEND", nullptr, 0);
+    if (options.sync)
+        ok = ok && flush_to_disk(file);
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <functional>
+#include <string>
+
+class ThreadPool;
+
+struct PngOptions {
+    int compression_level = 6; // 0: stored, no compression, 1: fastest .. 9: smallest file
+    ThreadPool* pool = nullptr; // encodes the bands as pool tasks when set
+    int band_rows = 0;          // rows per band, 0: about 256 KB of pixels
+    bool sync = false;          // flush_to_disk before closing, for files that are renamed into place
+};
+
+// Fills rgb with the 8 bit RGB values of row y, 0 being the top row. Called from several threads at
+// once when PngOptions::pool is set.
+typedef std::function<void(int y, unsigned char* rgb)> PngRowSource;
+
+// Writes an 8 bit RGB png. The image is encoded in bands of rows: every band converts and filters
+// its rows and deflates them on its own, ending with a sync flush (an empty stored block) so the
+// bands concatenate into one zlib stream, and becomes one IDAT chunk. Bands run in groups of twice
+// the pool size and every group is written before the next one starts, so only the bands in flight
+// are held in memory, never the whole frame. Matches do not reach across bands and the codes are
+// the fixed Huffman codes, like stbi_write_png. False when the file cannot be written.
+bool write_png(const std::string& path, int width, int height, const PngRowSource& row,
+    const PngOptions& options = PngOptions());
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// Random number engines
+//**************************************************************************************************
+// Every engine is a small value type: seed(key, sequence) fully determines the output,
+// so each thread can own one and renders stay reproducible whatever the scheduling.
+
+inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// PCG32 (XSH RR), http://www.pcg-random.org
+class Pcg32 {
+public:
+    Pcg32() { seed(0, 0); }
+    Pcg32(uint64_t key, uint64_t sequence) { seed(key, sequence); }
+
+    void seed(uint64_t key, uint64_t sequence) {
+        state = 0;
+        inc = (splitmix64(sequence) << 1) | 1;
+        next_uint();
+        state += splitmix64(key);
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        uint32_t rot = static_cast<uint32_t>(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+private:
+    uint64_t state, inc;
+};
+
+// xoshiro128+, http://prng.di.unimi.it
+class Xoshiro128Plus {
+public:
+    Xoshiro128Plus() { seed(0, 0); }
+    Xoshiro128Plus(uint64_t key, uint64_t sequence) { seed(key, sequence); }
+
+    void seed(uint64_t key, uint64_t sequence) {
+        uint64_t a = splitmix64(key ^ splitmix64(sequence));
+        uint64_t b = splitmix64(a);
+        s[0] = static_cast<uint32_t>(a);
+        s[1] = static_cast<uint32_t>(a >> 32);
+        s[2] = static_cast<uint32_t>(b);
+        s[3] = static_cast<uint32_t>(b >> 32) | 1; // never all zero
+    }
+
+    uint32_t next_uint() {
+        uint32_t result = s[0] + s[3];
+        uint32_t t = s[1] << 9;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = (s[3] << 11) | (s[3] >> 21);
+        return result;
+    }
+
+private:
+    uint32_t s[4];
+};
+
+// Engine used by the renderer, define RT_RNG_XOSHIRO to switch
+#ifdef RT_RNG_XOSHIRO
+typedef Xoshiro128Plus Rng;
+#else
+typedef Pcg32 Rng;
+#endif
+
+// Sampler
+//**************************************************************************************************
+// Per-thread sampling context handed to every function that consumes random numbers.
+// start_pixel_sample() reseeds the engine from (pixel, sample index, global seed), so the
+// random sequence of a path does not depend on which thread renders it or in which order.
+//
+// Each get_1d() call of a sample consumes the next dimension. The integrators pin the dimensions
+// of each bounce with start_bounce(), so a dimension always means the same thing:
+//   0, 1        pixel position
+//   2, 3        lens position and time (Camera::get_ray)
+//   4 + 4 b...  bounce b: up to 3 for Material::scatter, then Russian roulette at roulette_dimension(b)
+// Consecutive even / odd dimensions form 2D pairs for the samplers that stratify in 2D.
+
+enum class SamplerType {
+    Independent, // uniform random numbers
+    Stratified,  // one jittered stratum per sample in every dimension, strata randomly permuted
+    Halton,      // Halton sequence, randomly shifted per pixel and dimension
+    Sobol,       // Sobol (0,2) pairs with hash-based Owen scrambling and shuffled indices
+    BlueNoise    // one Owen-scrambled Sobol sequence shared by all pixels, Cranley-Patterson shifted
+                 // per pixel and dimension by a 64x64 void-and-cluster blue-noise mask
+};
+
+class Sampler {
+public:
+    static const int camera_dimensions = 4;
+    static const int bounce_dimensions = 4;
+
+    Sampler(uint64_t seed = 0, SamplerType type = SamplerType::Independent, int samples_per_pixel = 1)
+        : seed(seed), pixel_key(0), rng(seed, 0), type(type), samples_per_pixel(samples_per_pixel > 0 ? samples_per_pixel : 1),
+        x(0), y(0), sample_index(0), dimension(0) {}
+
+    void start_pixel_sample(int x, int y, int sample_index) {
+        uint64_t pixel = (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32) | static_cast<uint32_t>(x);
+        pixel_key = pixel ^ splitmix64(seed);
+        rng.seed(pixel_key, static_cast<uint64_t>(sample_index));
+        this->x = x;
+        this->y = y;
+        this->sample_index = sample_index;
+        dimension = 0;
+    }
+
+    void start_bounce(int bounce) { dimension = camera_dimensions + bounce * bounce_dimensions; }
+    static int roulette_dimension(int bounce) { return camera_dimensions + (bounce + 1) * bounce_dimensions - 1; }
+    void set_dimension(int dimension) { this->dimension = dimension; }
+
+    // Uniform in [0, 1)
+    float get_1d() {
+        if (type == SamplerType::Independent) {
+            dimension++;
+            return (rng.next_uint() >> 8) * (1.0f / 16777216.0f);
+        }
+        return sample_dimension(dimension++);
+    }
+
+    SamplerType get_type() const { return type; }
+
+private:
+    float sample_dimension(int dimension); // sampler.cpp
+
+    uint64_t seed;
+    uint64_t pixel_key;
+    Rng rng; // jitter of the stratified sampler, and dimensions the sequences do not cover
+    SamplerType type;
+    int samples_per_pixel;
+    int x, y, sample_index, dimension;
+};
+
+// Sampler used by the helpers that take no sampler (scene construction, BVH building).
+// Thread local with a fixed seed, so single-threaded setup code is deterministic.
+inline Sampler& default_sampler()
+{
+    thread_local Sampler sampler(0x5EED);
+    return sampler;
+}
+
+#endif
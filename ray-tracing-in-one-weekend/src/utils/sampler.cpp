@@ -0,0 +1,254 @@
+#include "random.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Low-discrepancy sequences of Sampler
+//**************************************************************************************************
+
+namespace {
+    float to_unit_float(uint32_t bits)
+    {
+        return (bits >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Independent 32 bit hashes of the dimensions of a key
+    uint32_t dimension_hash(uint64_t key, uint64_t dimension)
+    {
+        return static_cast<uint32_t>(splitmix64(key ^ (dimension * 0xD1B54A32D192ED03ull)));
+    }
+
+    uint32_t reverse_bits(uint32_t x)
+    {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    // Owen scrambling of the bits of x from the most significant down, Burley 2020,
+    // "Practical Hash-based Owen Scrambling"
+    uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+    {
+        x = reverse_bits(x);
+        x ^= x * 0x3d20adeau;
+        x += seed;
+        x *= (seed >> 16) | 1;
+        x ^= x * 0x05526c56u;
+        x ^= x * 0x53a22864u;
+        return reverse_bits(x);
+    }
+
+    // First two dimensions of the Sobol sequence: van der Corput, and the one of the polynomial x + 1.
+    // The second is linear in the bits of the index, so it is looked up one byte of the index at a time.
+    uint32_t sobol(uint32_t index, int dimension)
+    {
+        if (dimension == 0)
+            return reverse_bits(index);
+        static const std::vector<uint32_t> tables = []() {
+            std::vector<uint32_t> table(4 * 256);
+            for (int k = 0; k < 4; k++) {
+                for (uint32_t byte = 0; byte < 256; byte++) {
+                    uint32_t result = 0, direction = 0x80000000u;
+                    for (uint32_t bits = byte << (8 * k); bits != 0; bits >>= 1) {
+                        if (bits & 1)
+                            result ^= direction;
+                        direction ^= direction >> 1;
+                    }
+                    table[k * 256 + byte] = result;
+                }
+            }
+            return table;
+        }();
+        return tables[index & 255] ^ tables[256 + ((index >> 8) & 255)]
+            ^ tables[512 + ((index >> 16) & 255)] ^ tables[768 + (index >> 24)];
+    }
+
+    // Sobol value of sample s, Owen scrambled by key. Both dimensions of a pair (2k, 2k + 1) shuffle
+    // the sample indices the same way, so the pairs stay (0,2) sequences.
+    uint32_t owen_sobol(uint32_t s, int dimension, uint64_t key)
+    {
+        uint32_t index = nested_uniform_scramble(s, dimension_hash(key, dimension / 2));
+        return nested_uniform_scramble(sobol(index, dimension & 1), dimension_hash(~key, dimension));
+    }
+
+    // Element i of a random permutation of [0, n) chosen by p, Kensler 2013,
+    // "Correlated Multi-Jittered Sampling"
+    uint32_t permutation_element(uint32_t i, uint32_t n, uint32_t p)
+    {
+        uint32_t w = n - 1;
+        w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+        do {
+            i ^= p; i *= 0xe170893du; i ^= p >> 16; i ^= (i & w) >> 4;
+            i ^= p >> 8; i *= 0x0929eb3fu; i ^= p >> 23; i ^= (i & w) >> 1;
+            i *= 1 | p >> 27; i *= 0x6935fa69u; i ^= (i & w) >> 11; i *= 0x74dcb303u;
+            i ^= (i & w) >> 2; i *= 0x9e501cc3u; i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+            i &= w; i ^= i >> 5;
+        } while (i >= n);
+        return (i + p) % n;
+    }
+
+    // Bases of the Halton dimensions
+    const std::vector<uint32_t>& primes()
+    {
+        static const std::vector<uint32_t> table = []() {
+            std::vector<uint32_t> found;
+            for (uint32_t n = 2; found.size() < 256; n++) {
+                bool prime = true;
+                for (uint32_t p : found) {
+                    if (p * p > n)
+                        break;
+                    if (n % p == 0) {
+                        prime = false;
+                        break;
+                    }
+                }
+                if (prime)
+                    found.push_back(n);
+            }
+            return found;
+        }();
+        return table;
+    }
+
+    float radical_inverse(uint32_t base, uint32_t index)
+    {
+        double inv_base = 1.0 / base, scale = 1.0, result = 0.0;
+        while (index != 0) {
+            uint32_t next = index / base;
+            scale *= inv_base;
+            result += (index - next * base) * scale;
+            index = next;
+        }
+        return std::min(static_cast<float>(result), 0.99999994f);
+    }
+
+    // 64x64 ranks of a void-and-cluster pattern (Ulichney 1993), as values in (0, 1). Thresholding
+    // it at any level leaves evenly spread pixels, so offsetting neighbouring pixels by it turns the
+    // error of a per-pixel sequence into high-frequency noise.
+    const int blue_noise_size = 64;
+
+    const std::vector<float>& blue_noise_mask()
+    {
+        static const std::vector<float> mask = []() {
+            const int n = blue_noise_size, count = n * n;
+            const float sigma = 1.5f;
+
+            // Gaussian energy of a set pixel at toroidal offset (dx, dy)
+            std::vector<float> kernel(count);
+            for (int dy = 0; dy < n; dy++) {
+                for (int dx = 0; dx < n; dx++) {
+                    int wx = std::min(dx, n - dx), wy = std::min(dy, n - dy);
+                    kernel[dx + dy * n] = std::exp(-(wx * wx + wy * wy) / (2.0f * sigma * sigma));
+                }
+            }
+            std::vector<uint8_t> set(count, 0);
+            std::vector<float> energy(count, 0.0f);
+            auto toggle = [&](int p, float sign) {
+                set[p] = sign > 0 ? 1 : 0;
+                int px = p % n, py = p / n;
+                for (int q = 0; q < count; q++) {
+                    int dx = (q % n - px + n) % n, dy = (q / n - py + n) % n;
+                    energy[q] += sign * kernel[dx + dy * n];
+                }
+            };
+            // Set pixel with the highest energy, or unset pixel with the lowest
+            auto find = [&](bool cluster) {
+                int best = -1;
+                for (int q = 0; q < count; q++) {
+                    if (set[q] != (cluster ? 1 : 0))
+                        continue;
+                    if (best < 0 || (cluster ? energy[q] > energy[best] : energy[q] < energy[best]))
+                        best = q;
+                }
+                return best;
+            };
+
+            // Initial pattern: a tenth of the pixels at random, spread by moving the tightest cluster
+            // into the largest void until that stops changing anything
+            Pcg32 rng(0xB1, 0x0E);
+            int initial = count / 10;
+            for (int placed = 0; placed < initial; ) {
+                int p = static_cast<int>(rng.next_uint() % count);
+                if (!set[p]) {
+                    toggle(p, 1.0f);
+                    placed++;
+                }
+            }
+            for (int iteration = 0; iteration < count; iteration++) {
+                int cluster = find(true);
+                toggle(cluster, -1.0f);
+                int void_pixel = find(false);
+                if (void_pixel == cluster) {
+                    toggle(cluster, 1.0f);
+                    break;
+                }
+                toggle(void_pixel, 1.0f);
+            }
+
+            std::vector<int> rank(count);
+            std::vector<uint8_t> pattern = set;
+            std::vector<float> pattern_energy = energy;
+            // Ranks below the initial pattern: remove the tightest clusters one by one
+            for (int r = initial - 1; r >= 0; r--) {
+                int cluster = find(true);
+                toggle(cluster, -1.0f);
+                rank[cluster] = r;
+            }
+            // Ranks above it: fill the largest voids one by one
+            set = pattern;
+            energy = pattern_energy;
+            for (int r = initial; r < count; r++) {
+                int void_pixel = find(false);
+                toggle(void_pixel, 1.0f);
+                rank[void_pixel] = r;
+            }
+
+            std::vector<float> values(count);
+            for (int p = 0; p < count; p++)
+                values[p] = (rank[p] + 0.5f) / count;
+            return values;
+        }();
+        return mask;
+    }
+}
+
+float Sampler::sample_dimension(int dimension)
+{
+    const uint32_t s = static_cast<uint32_t>(sample_index);
+
+    switch (type) {
+    case SamplerType::Stratified: {
+        // Sample s falls in a different stratum of every dimension, the strata of samples beyond
+        // samples_per_pixel (adaptive sampling) are permuted again for each further round
+        uint32_t n = static_cast<uint32_t>(samples_per_pixel);
+        uint32_t stratum = permutation_element(s % n, n, dimension_hash(pixel_key ^ (s / n), dimension));
+        return std::min((stratum + to_unit_float(rng.next_uint())) / n, 0.99999994f);
+    }
+    case SamplerType::Halton: {
+        const std::vector<uint32_t>& bases = primes();
+        if (dimension >= static_cast<int>(bases.size()))
+            break;
+        float shifted = radical_inverse(bases[dimension], s) + to_unit_float(dimension_hash(pixel_key, dimension));
+        return shifted < 1.0f ? shifted : shifted - 1.0f;
+    }
+    case SamplerType::Sobol:
+        return to_unit_float(owen_sobol(s, dimension, pixel_key));
+    case SamplerType::BlueNoise: {
+        // Every pixel runs the same scrambled Sobol sequence, shifted by the mask value of the pixel;
+        // each dimension reads the mask at its own offset
+        uint32_t offset = dimension_hash(seed, dimension);
+        int mx = (x + static_cast<int>(offset & 63)) & (blue_noise_size - 1);
+        int my = (y + static_cast<int>((offset >> 6) & 63)) & (blue_noise_size - 1);
+        float shifted = to_unit_float(owen_sobol(s, dimension, splitmix64(seed)))
+            + blue_noise_mask()[mx + my * blue_noise_size];
+        return shifted < 1.0f ? shifted : shifted - 1.0f;
+    }
+    default:
+        break;
+    }
+    return to_unit_float(rng.next_uint());
+}
@@ -0,0 +1,76 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Instruction set detection and the attributes needed to use wider instruction sets
+// than the ones the whole program is compiled for.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define RT_FORCE_INLINE __forceinline
+#define RT_TARGET_AVX
+#define RT_TARGET_AVX2
+#define RT_TARGET_AVX512
+#define RT_FLATTEN
+#else
+#define RT_FORCE_INLINE inline __attribute__((always_inline))
+// GCC and Clang only emit AVX instructions in functions marked for it; such a function must
+// flatten its callees for the AVX kernels to be inlined into it.
+#define RT_TARGET_AVX __attribute__((target("avx")))
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#define RT_TARGET_AVX512 __attribute__((target("avx512f")))
+#define RT_FLATTEN __attribute__((flatten))
+#endif
+
+// True when the CPU and the operating system both support AVX
+inline bool cpu_supports_avx()
+{
+#if defined(RT_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#elif defined(RT_X86)
+    return __builtin_cpu_supports("avx");
+#else
+    return false;
+#endif
+}
+
+// True when the CPU and the operating system both support AVX2
+inline bool cpu_supports_avx2()
+{
+#if defined(RT_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return cpu_supports_avx() && (info[1] & (1 << 5)) != 0;
+#elif defined(RT_X86)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+// True when the CPU and the operating system both support AVX-512 Foundation
+inline bool cpu_supports_avx512f()
+{
+#if defined(RT_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    // The OS must save the opmask and the upper halves of the 32 ZMM registers
+    return cpu_supports_avx() && (info[1] & (1 << 16)) != 0 && (_xgetbv(0) & 0xe6) == 0xe6;
+#elif defined(RT_X86)
+    return __builtin_cpu_supports("avx512f");
+#else
+    return false;
+#endif
+}
+
+#endif
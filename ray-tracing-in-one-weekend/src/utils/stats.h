@@ -0,0 +1,82 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+
+// Statistics
+//**************************************************************************************************
+
+// Counts of the work of a render. Hot paths increment the counters of their thread inside RT_STAT;
+// Renderer merges the part of every tile into its totals, like thread_traversal_stats(). Box tests
+// (Aabb::hit) are the node visits of TraversalStats, which the BVHs count in a local copy per query:
+// a thread-local increment per box test costs several percent of the render time. With
+// RT_NO_STATS defined (the ReleaseNoStats configuration) RT_STAT expands to nothing, and the
+// TraversalStats of the BVHs are never stored either, so the compiler drops their counting too.
+#ifdef RT_NO_STATS
+#define RT_STAT(statement) do {} while (false)
+#else
+#define RT_STAT(statement) do { statement; } while (false)
+#endif
+
+struct RayStats {
+    static const int depth_bins = 16; // rays of bounce depth depth_bins - 1 and deeper share the last bin
+
+    uint64_t rays[depth_bins] = {};   // closest-hit queries of the integrators by bounce depth, 0: camera rays
+    uint64_t ray_hits[depth_bins] = {};
+    uint64_t sphere_tests = 0;        // Sphere::hit and MovingSphere::hit
+    uint64_t sphere_hits = 0;
+    uint64_t scatter_events = 0;      // Material::scatter calls that continued the path
+
+    static int depth_bin(int depth) { return depth < depth_bins - 1 ? depth : depth_bins - 1; }
+
+    void add_ray(int depth, bool hit) {
+        rays[depth_bin(depth)]++;
+        ray_hits[depth_bin(depth)] += hit ? 1 : 0;
+    }
+
+    uint64_t total_rays() const {
+        uint64_t total = 0;
+        for (uint64_t count : rays)
+            total += count;
+        return total;
+    }
+
+    uint64_t total_hits() const {
+        uint64_t total = 0;
+        for (uint64_t count : ray_hits)
+            total += count;
+        return total;
+    }
+
+    RayStats& operator+=(const RayStats& other) {
+        for (int d = 0; d < depth_bins; d++) {
+            rays[d] += other.rays[d];
+            ray_hits[d] += other.ray_hits[d];
+        }
+        sphere_tests += other.sphere_tests;
+        sphere_hits += other.sphere_hits;
+        scatter_events += other.scatter_events;
+        return *this;
+    }
+
+    RayStats operator-(const RayStats& other) const {
+        RayStats difference;
+        for (int d = 0; d < depth_bins; d++) {
+            difference.rays[d] = rays[d] - other.rays[d];
+            difference.ray_hits[d] = ray_hits[d] - other.ray_hits[d];
+        }
+        difference.sphere_tests = sphere_tests - other.sphere_tests;
+        difference.sphere_hits = sphere_hits - other.sphere_hits;
+        difference.scatter_events = scatter_events - other.scatter_events;
+        return difference;
+    }
+};
+
+// Counters of the calling thread
+inline RayStats& thread_ray_stats()
+{
+    thread_local RayStats stats;
+    return stats;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "thread_pool.h"
+
+namespace {
+    // Identifies the pool and queue owned by the current worker thread, if any.
+    thread_local const ThreadPool* current_pool = nullptr;
+    thread_local size_t current_queue = 0;
+}
+
+ThreadPool::ThreadPool(int thread_count)
+{
+    if (thread_count <= 0)
+        thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    if (thread_count <= 0)
+        thread_count = 1;
+
+    size_t worker_count = static_cast<size_t>(thread_count - 1);
+    for (size_t i = 0; i <= worker_count; i++)
+        queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    for (size_t i = 0; i < worker_count; i++)
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    size_t index = current_pool == this
+        ? current_queue
+        : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1, std::memory_order_release);
+    {
+        // Taking the lock orders the push with a worker going to sleep
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::pop_task(size_t self, std::function<void()>& task)
+{
+    if (queued.load(std::memory_order_acquire) == 0)
+        return false;
+
+    // Own queue first, newest task
+    {
+        WorkQueue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // Steal the oldest task of another queue
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkQueue& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::run_pending_task()
+{
+    size_t self = current_pool == this ? current_queue : queues.size() - 1;
+    std::function<void()> task;
+    if (!pop_task(self, task))
+        return false;
+    task();
+    return true;
+}
+
+void ThreadPool::worker_loop(size_t index)
+{
+    current_pool = this;
+    current_queue = index;
+
+    std::function<void()> task;
+    while (true) {
+        if (pop_task(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+    pending.fetch_add(1, std::memory_order_relaxed);
+    pool.submit([this, task]() {
+        task();
+        pending.fetch_sub(1, std::memory_order_release);
+    });
+}
+
+void TaskGroup::wait()
+{
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (!pool.run_pending_task())
+            std::this_thread::yield();
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+// Every worker owns a deque: it pops its own tasks from the back (LIFO, cache friendly)
+// and steals from the front of the other deques (FIFO, oldest = largest work) when idle.
+// The thread that waits on a TaskGroup helps executing tasks, so a pool created with
+// thread_count = N spawns N - 1 workers and a pool of 1 runs everything on the caller.
+class ThreadPool {
+public:
+    explicit ThreadPool(int thread_count = 0); // 0: std::thread::hardware_concurrency()
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads taking part in the work, including the waiting caller.
+    int size() const { return static_cast<int>(workers.size()) + 1; }
+
+    void submit(std::function<void()> task);
+
+    // Runs one queued task on the calling thread, returns false if every queue is empty.
+    bool run_pending_task();
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool pop_task(size_t self, std::function<void()>& task);
+    void worker_loop(size_t index);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues; // workers.size() + 1, the last one is for external threads
+    std::atomic<int> queued{ 0 };
+    std::atomic<size_t> next_queue{ 0 };
+    std::atomic<bool> stopping{ false };
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+};
+
+// A set of tasks that can be waited on together. wait() executes pending pool tasks
+// while the group is unfinished, so tasks may themselves spawn and wait on groups.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+    ~TaskGroup() { wait(); }
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    ThreadPool& pool;
+    std::atomic<int> pending{ 0 };
+};
+
+#endif
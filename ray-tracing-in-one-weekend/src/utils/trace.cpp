@@ -0,0 +1,124 @@
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> trace_enabled(false);
+
+// Events of one thread. Only the owning thread writes; it publishes every event by a release store
+// of the count, so a reader that loads the count with acquire sees complete events below it.
+struct TraceBuffer {
+    static const uint64_t capacity = 1 << 15; // power of two, slot = event index & (capacity - 1)
+
+    std::unique_ptr<TraceEvent[]> events{ new TraceEvent[capacity] };
+    std::atomic<uint64_t> recorded{ 0 };      // events ever recorded, including the overwritten ones
+    int thread_index = 0;
+};
+
+// The buffers outlive their threads, so the pool workers may finish before the trace is written
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    std::string path;
+};
+
+static TraceRegistry& trace_registry()
+{
+    static TraceRegistry registry;
+    return registry;
+}
+
+static TraceBuffer* register_trace_buffer()
+{
+    TraceRegistry& registry = trace_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.buffers.emplace_back(new TraceBuffer);
+    registry.buffers.back()->thread_index = static_cast<int>(registry.buffers.size()) - 1;
+    return registry.buffers.back().get();
+}
+
+uint64_t trace_now_ns()
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count());
+}
+
+static TraceBuffer* thread_trace_buffer()
+{
+    thread_local TraceBuffer* buffer = register_trace_buffer();
+    return buffer;
+}
+
+void record_trace_event(const TraceEvent& event)
+{
+    TraceBuffer* buffer = thread_trace_buffer();
+    uint64_t index = buffer->recorded.load(std::memory_order_relaxed);
+    buffer->events[index & (TraceBuffer::capacity - 1)] = event;
+    buffer->recorded.store(index + 1, std::memory_order_release);
+}
+
+static void write_trace_at_exit()
+{
+    const std::string& path = trace_registry().path;
+    if (!write_trace(path))
+        std::cerr << "Cannot write trace " << path << "\n";
+}
+
+void enable_tracing(const std::string& path)
+{
+    // The registry is constructed before the handler is registered, so it is destroyed after it runs
+    trace_registry().path = path;
+    trace_now_ns();
+    thread_trace_buffer(); // the thread enabling tracing gets track 0
+    if (!trace_enabled.exchange(true))
+        std::atexit(write_trace_at_exit);
+}
+
+bool write_trace(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+
+    TraceRegistry& registry = trace_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    uint64_t dropped = 0;
+    bool first = true;
+    auto separator = [&]() {
+        fputs(first ? "\n" : ",\n", file);
+        first = false;
+    };
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    for (const std::unique_ptr<TraceBuffer>& buffer : registry.buffers) {
+        int tid = buffer->thread_index;
+        separator();
+        std::string thread_name = tid == 0 ? "main" : "thread " + std::to_string(tid);
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            tid, thread_name.c_str());
+
+        uint64_t recorded = buffer->recorded.load(std::memory_order_acquire);
+        uint64_t begin = recorded > TraceBuffer::capacity ? recorded - TraceBuffer::capacity : 0;
+        dropped += begin;
+        for (uint64_t i = begin; i < recorded; i++) {
+            const TraceEvent& event = buffer->events[i & (TraceBuffer::capacity - 1)];
+            // Complete events, times in microseconds
+            separator();
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                event.name, tid, event.start_ns / 1000.0, event.duration_ns / 1000.0);
+            if (event.arg_name)
+                fprintf(file, ",\"args\":{\"%s\":%lld}", event.arg_name, static_cast<long long>(event.arg));
+            fputs("}", file);
+        }
+    }
+    fputs("\n]}\n", file);
+    bool ok = fclose(file) == 0;
+    if (dropped > 0)
+        std::cerr << "Trace: " << dropped << " events were overwritten in full ring buffers\n";
+    return ok;
+}
@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Tracing
+//**************************************************************************************************
+
+// RT_TRACE_SCOPE(name) or RT_TRACE_SCOPE(name, arg_name, arg) records the time until the end of the
+// enclosing scope as an event of the calling thread, once enable_tracing() was called. Every thread
+// appends to its own ring buffer without locks; a full buffer overwrites its oldest events. Names
+// are only kept as pointers and must be string literals. While tracing is disabled a scope costs
+// one relaxed atomic load.
+#define RT_TRACE_CONCAT_(a, b) a##b
+#define RT_TRACE_CONCAT(a, b) RT_TRACE_CONCAT_(a, b)
+#define RT_TRACE_SCOPE(...) TraceScope RT_TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+
+struct TraceEvent {
+    const char* name;
+    const char* arg_name; // nullptr: the event has no argument
+    int64_t arg;
+    uint64_t start_ns;    // since the first call of trace_now_ns()
+    uint64_t duration_ns;
+};
+
+extern std::atomic<bool> trace_enabled;
+
+inline bool tracing_enabled() { return trace_enabled.load(std::memory_order_relaxed); }
+
+uint64_t trace_now_ns();
+
+// Appends to the ring buffer of the calling thread, which is created on its first event
+void record_trace_event(const TraceEvent& event);
+
+// Starts recording and writes the events to path when the program exits
+void enable_tracing(const std::string& path);
+
+// Chrome trace-event JSON (chrome://tracing, Perfetto) of the recorded events, one track per thread.
+// The buffers are read without stopping their threads, so call it while no scope is being closed.
+bool write_trace(const std::string& path);
+
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+        : name(tracing_enabled() ? name : nullptr), arg_name(arg_name), arg(arg),
+        start_ns(this->name ? trace_now_ns() : 0) {}
+
+    ~TraceScope() {
+        if (name)
+            record_trace_event(TraceEvent{ name, arg_name, arg, start_ns, trace_now_ns() - start_ns });
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name; // nullptr: tracing was disabled when the scope began
+    const char* arg_name;
+    int64_t arg;
+    uint64_t start_ns;
+};
+
+#endif